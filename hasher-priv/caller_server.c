@@ -1,4 +1,3 @@
-#include <sys/param.h> /* MAXPATHLEN */
 #include <sys/socket.h> /* SOCK_CLOEXEC */
 #include <sys/prctl.h>
 #include <sys/signalfd.h>
@@ -16,9 +15,10 @@
 #include "logging.h"
 #include "epoll.h"
 #include "communication.h"
+#include "session.h"
+#include "cgroup.h"
 
 static int finish_server = 0;
-static char socketpath[MAXPATHLEN];
 
 static char session_caps[] = "cap_setgid,cap_setuid,cap_kill,cap_mknod,cap_sys_chroot,cap_sys_admin=ep";
 
@@ -46,19 +46,15 @@ handle_signal(uint32_t signo)
 	return 0;
 }
 
+/*
+ * Connections are handed over by hasher-privd which has already
+ * checked the credentials of the caller.
+ */
 static int
 process_task(int conn)
 {
-	uid_t uid;
-	gid_t gid;
-
-	if (get_peercred(conn, NULL, &uid, &gid) < 0)
-		return -1;
-
-	if (caller_uid != uid || caller_gid != gid) {
-		err("user (uid=%d) don't have permission to send commands to the session of user (uid=%d)", uid, caller_uid);
+	if (set_recv_timeout(conn, 3) < 0)
 		return -1;
-	}
 
 	caller_task(conn);
 
@@ -167,16 +163,14 @@ set_rlimits(void)
 }
 
 static int
-caller_server(int cl_conn, uid_t uid, gid_t gid, unsigned num)
+caller_server(int cl_conn, int *cl_pair, int fd_ctl, uid_t uid, gid_t gid, unsigned num)
 {
 	int i;
 	unsigned long nsec;
 	sigset_t mask;
-	char *sockname;
 
 	int fd_ep     = -1;
 	int fd_signal = -1;
-	int fd_conn   = -1;
 
 	if (init_caller_data(uid, gid) < 0)
 		return -1;
@@ -187,18 +181,8 @@ caller_server(int cl_conn, uid_t uid, gid_t gid, unsigned num)
 
 	umask(077);
 
-	xasprintf(&sockname, "hasher-priv-%d-%d", caller_uid, caller_num);
-
-	if ((fd_conn = unix_listen(SOCKETDIR, sockname)) < 0)
-		return -1;
-
-	snprintf(socketpath, sizeof(socketpath), "%s/%s", SOCKETDIR, sockname);
-
-	if (chown(socketpath, caller_uid, caller_gid)) {
-		err("fchown: %s: %m", socketpath);
-		return -1;
-	}
-	free(sockname);
+	/* Failure is fatal only if some cgroup limits are configured. */
+	(void) cgroup_session_create(uid, gid, num);
 
 	if (drop_privs() < 0)
 		return -1;
@@ -208,6 +192,9 @@ caller_server(int cl_conn, uid_t uid, gid_t gid, unsigned num)
 
 	set_rlimits();
 
+	if (cgroup_set_limits() < 0)
+		return -1;
+
 	sigfillset(&mask);
 	sigprocmask(SIG_SETMASK, &mask, NULL);
 
@@ -219,14 +206,21 @@ caller_server(int cl_conn, uid_t uid, gid_t gid, unsigned num)
 		return -1;
 	}
 
-	if (epollin_add(fd_ep, fd_signal) < 0 || epollin_add(fd_ep, fd_conn) < 0) {
+	if (epollin_add(fd_ep, fd_signal) < 0 || epollin_add(fd_ep, fd_ctl) < 0) {
 		err("epollin_add: failed");
 		return -1;
 	}
 
-	/* Tell client that caller server is ready */
-	send_command_response(cl_conn, CMD_STATUS_DONE, NULL);
-	close(cl_conn);
+	/* Tell client that caller server is ready and give it the connection */
+	if (cl_conn >= 0) {
+		if (!send_command_response(cl_conn, CMD_STATUS_DONE, NULL))
+			fds_send(cl_conn, &cl_pair[1], 1);
+		close(cl_pair[1]);
+		close(cl_conn);
+
+		process_task(cl_pair[0]);
+		close(cl_pair[0]);
+	}
 
 	nsec = 0;
 	while (!finish_server) {
@@ -263,16 +257,12 @@ caller_server(int cl_conn, uid_t uid, gid_t gid, unsigned num)
 
 				handle_signal(fdsi.ssi_signo);
 
-			} else if (ev[i].data.fd == fd_conn) {
+			} else if (ev[i].data.fd == fd_ctl) {
 				int conn;
 
-				if ((conn = accept4(fd_conn, NULL, 0, SOCK_CLOEXEC)) < 0) {
-					err("accept4: %m");
-					continue;
-				}
-
-				if (set_recv_timeout(conn, 3) < 0) {
-					close(conn);
+				/* hasher-privd has gone away */
+				if (recv_fds(fd_ctl, sizeof(conn), &conn) < 0) {
+					finish_server = 1;
 					continue;
 				}
 
@@ -288,32 +278,71 @@ caller_server(int cl_conn, uid_t uid, gid_t gid, unsigned num)
 
 	if (fd_ep >= 0) {
 		epollin_remove(fd_ep, fd_signal);
-		epollin_remove(fd_ep, fd_conn);
+		epollin_remove(fd_ep, fd_ctl);
 		close(fd_ep);
 	}
 
 	info("%s(%d): finish session server", caller_user, caller_uid);
-	unlink(socketpath);
 
 	return 0;
 }
 
+static void
+close_session_fds(struct session *s, __attribute__ ((unused)) void *data)
+{
+	if (s->server_pidfd >= 0)
+		close(s->server_pidfd);
+	if (s->server_ctl >= 0)
+		close(s->server_ctl);
+}
+
+/*
+ * Fork a session server. If CL_CONN is specified, the client waiting
+ * on it gets the second end of CL_PAIR once the server is ready and
+ * the first end is served as a regular connection. The hasher-privd
+ * end of the control socket is returned in CTL.
+ */
 pid_t
-fork_server(int cl_conn, uid_t uid, gid_t gid, unsigned num)
+fork_server(int cl_conn, int *cl_pair, uid_t uid, gid_t gid, unsigned num, int *ctl)
 {
 	int rc;
+	int sv[2];
+	int cg;
 	pid_t pid;
 
-	if ((pid = fork()) != 0) {
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		err("socketpair: %m");
+		return -1;
+	}
+
+	cg = cgroup_session_leaf(uid, num);
+
+	pid = cgroup_fork(cg);
+
+	if (cg >= 0)
+		close(cg);
+
+	if (pid != 0) {
+		close(sv[1]);
+
 		if (pid < 0) {
 			err("fork: %m");
+			close(sv[0]);
 			return -1;
 		}
+
+		*ctl = sv[0];
 		return pid;
 	}
 
-	if ((rc = caller_server(cl_conn, uid, gid, num)) < 0) {
-		send_command_response(cl_conn, CMD_STATUS_FAILED, NULL);
+	close(sv[0]);
+
+	/* Descriptors of other sessions must not leak into this one. */
+	session_foreach(close_session_fds, NULL);
+
+	if ((rc = caller_server(cl_conn, cl_pair, sv[1], uid, gid, num)) < 0) {
+		if (cl_conn >= 0)
+			send_command_response(cl_conn, CMD_STATUS_FAILED, NULL);
 		exit(EXIT_FAILURE);
 	}
 
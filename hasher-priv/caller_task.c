@@ -2,11 +2,14 @@
 #include <sys/un.h>
 #include <sys/param.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "communication.h"
 #include "xmalloc.h"
@@ -19,6 +22,8 @@ struct task {
 
 	unsigned num;
 
+	uint32_t flags;
+
 	int stdin;
 	int stdout;
 	int stderr;
@@ -191,28 +196,326 @@ process_task(struct task *task)
 	exit(rc);
 }
 
+/* Upper limit for the arguments and environment of a submitted task. */
+#define TASK_SUBMIT_MAX_PAYLOAD (16UL * 1024 * 1024)
+
+static int
+check_payload_memfd(int fd, uint64_t size)
+{
+#ifdef F_GET_SEALS
+	int seals;
+	struct stat st;
+	const int required = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+
+	if ((seals = fcntl(fd, F_GET_SEALS)) < 0) {
+		err("fcntl(F_GET_SEALS): %m");
+		return -1;
+	}
+
+	if ((seals & required) != required) {
+		err("task payload is not sealed");
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		err("fstat: %m");
+		return -1;
+	}
+
+	if ((uint64_t) st.st_size != size) {
+		err("task payload size mismatch");
+		return -1;
+	}
+
+	return 0;
+#else
+	(void) fd;
+	(void) size;
+	err("sealed task payload is not supported");
+	return -1;
+#endif
+}
+
+/*
+ * Receive the body of CMD_TASK_SUBMIT. FDS holds the descriptors
+ * received along with the command header: stdin, stdout, stderr
+ * and optionally the memfd with arguments and environment.
+ */
+static int
+recv_task_submit(int conn, struct cmd *hdr, int *fds, size_t nfds, struct task *task)
+{
+	struct task_submit ts = {};
+	uint64_t payload;
+	int rc = -1;
+
+	if (hdr->datalen < sizeof(ts)) {
+		err("task submit: message too short");
+		goto out;
+	}
+
+	if (xrecvmsg(conn, &ts, sizeof(ts)) < 0)
+		goto out;
+
+	if (ts.version != PROTOCOL_VERSION) {
+		err("task submit: unsupported protocol version: %u", ts.version);
+		goto out;
+	}
+
+	if (ts.argvlen > TASK_SUBMIT_MAX_PAYLOAD || ts.envlen > TASK_SUBMIT_MAX_PAYLOAD) {
+		err("task submit: arguments too long");
+		goto out;
+	}
+
+	payload = (ts.flags & TASK_SUBMIT_MEMFD) ? 0 : ts.argvlen + ts.envlen;
+
+	if (hdr->datalen != sizeof(ts) + payload ||
+	    nfds != ((ts.flags & TASK_SUBMIT_MEMFD) ? 4 : 3)) {
+		err("task submit: malformed message");
+		goto out;
+	}
+
+	task->type  = ts.type;
+	task->flags = ts.flags;
+
+	if (ts.flags & TASK_SUBMIT_MEMFD) {
+		if (check_payload_memfd(fds[3], ts.argvlen + ts.envlen) < 0 ||
+		    pread_list(fds[3], 0, ts.argvlen, &task->argv) < 0 ||
+		    pread_list(fds[3], (off_t) ts.argvlen, ts.envlen, &task->env) < 0)
+			goto out;
+	} else {
+		if (recv_list(conn, ts.argvlen, &task->argv) < 0 ||
+		    recv_list(conn, ts.envlen, &task->env) < 0)
+			goto out;
+	}
+
+	if (validate_arguments(task->type, task->argv) < 0)
+		goto out;
+
+	task->stdin  = fds[0];
+	task->stdout = fds[1];
+	task->stderr = fds[2];
+	nfds = 3;
+
+	rc = 0;
+out:
+	while (nfds > 0) {
+		nfds--;
+		if (rc < 0 || nfds >= 3)
+			close(fds[nfds]);
+	}
+
+	return rc;
+}
+
+static void
+free_task_lists(struct task *task)
+{
+	if (task->env) {
+		free(task->env[0]);
+		free(task->env);
+		task->env = NULL;
+	}
+
+	if (task->argv) {
+		free(task->argv[0]);
+		free(task->argv);
+		task->argv = NULL;
+	}
+}
+
+static void
+close_task_fds(struct task *task)
+{
+	if (task->stdin)
+		close(task->stdin);
+
+	if (task->stdout)
+		close(task->stdout);
+
+	if (task->stderr)
+		close(task->stderr);
+
+	task->stdin = task->stdout = task->stderr = 0;
+}
+
+/*
+ * Wait for the task process. Return its exit status, or 128 plus
+ * the signal number if it was killed.
+ */
+static int
+wait_task(struct task *task, pid_t cpid)
+{
+	while (1) {
+		int wstatus;
+
+		if (waitpid(cpid, &wstatus, WUNTRACED | WCONTINUED) < 0) {
+			err("waitpid: %m");
+			return EXIT_FAILURE;
+		}
+
+		if (WIFEXITED(wstatus)) {
+			info("%s: process %d exited, status=%d", task2str(task->type), cpid, WEXITSTATUS(wstatus));
+			return WEXITSTATUS(wstatus);
+		}
+
+		if (WIFSIGNALED(wstatus)) {
+			info("%s: process %d killed by signal %d", task2str(task->type), cpid, WTERMSIG(wstatus));
+			return 128 + WTERMSIG(wstatus);
+		}
+	}
+}
+
+/*
+ * Tasks which only print values the session server already knows
+ * do not need a process. Return their output or NULL if the task
+ * has to be run by process_task().
+ */
+static char *
+task_output(struct task *task)
+{
+	switch (task->type) {
+		case TASK_GETCONF:
+			return getconf_output();
+		case TASK_GETUGID1:
+			return getugid1_output();
+		case TASK_GETUGID2:
+			return getugid2_output();
+		default:
+			return NULL;
+	}
+}
+
+/* Answer the task in the response message if possible. */
+static int
+answer_task(int conn, struct task *task)
+{
+	char *output;
+
+	if (!(output = task_output(task)))
+		return 1;
+
+	dbg("%s: answered by session server", task2str(task->type));
+
+	send_command_response(conn, CMD_STATUS_DONE, "%s", output);
+	free(output);
+
+	return 0;
+}
+
+/*
+ * Run one task of a batch and send its status. Tasks following
+ * a failed one are skipped unless they are independent.
+ */
+static int
+run_batch_task(int conn, struct cmd *hdr, int *fds, size_t nfds, struct task *task, int *failed)
+{
+	int status = EXIT_FAILURE;
+	char *output;
+	pid_t cpid;
+
+	free_task_lists(task);
+
+	if (recv_task_submit(conn, hdr, fds, nfds, task) < 0)
+		return -1;
+
+	if (*failed && !(task->flags & TASK_SUBMIT_INDEPENDENT)) {
+		close_task_fds(task);
+		send_command_response(conn, CMD_STATUS_FAILED, "%s: skipped", task2str(task->type));
+		return 0;
+	}
+
+	/* Keep the output ordered with the output of other tasks. */
+	if ((output = task_output(task)) != NULL) {
+		size_t len = strlen(output);
+
+		status = (write_loop(task->stdout, output, len) == (ssize_t) len) ? 0 : EXIT_FAILURE;
+		free(output);
+
+	} else if ((cpid = process_task(task)) >= 0)
+		status = wait_task(task, cpid);
+
+	close_task_fds(task);
+
+	if (!status) {
+		send_command_response(conn, CMD_STATUS_DONE, NULL);
+		return 0;
+	}
+
+	if (!(task->flags & TASK_SUBMIT_INDEPENDENT))
+		*failed = 1;
+
+	send_command_response(conn, CMD_STATUS_FAILED, "%s: exit status %d", task2str(task->type), status);
+	return 0;
+}
+
+/*
+ * The first command is read by the session server itself. A submitted
+ * task which can be answered without forking is handled right there,
+ * everything else is served by a forked process.
+ */
 int
 caller_task(int conn)
 {
-	int fds[3];
+	int fds[TASK_SUBMIT_MAX_FDS];
+	size_t nfds = TASK_SUBMIT_MAX_FDS;
 	int rc = EXIT_FAILURE;
+	int batch = 0, failed = 0, pending = 1;
 	struct task task = {};
+	struct cmd hdr = {};
 	pid_t pid, cpid;
 
+	if (recv_cmd(conn, &hdr, fds, &nfds) < 0)
+		return -1;
+
+	if (hdr.type == CMD_TASK_SUBMIT) {
+		if (recv_task_submit(conn, &hdr, fds, nfds, &task) < 0) {
+			send_command_response(conn, CMD_STATUS_FAILED, "command failed");
+			free_task_lists(&task);
+			return -1;
+		}
+
+		if (!answer_task(conn, &task)) {
+			close_task_fds(&task);
+			free_task_lists(&task);
+			return 0;
+		}
+	}
+
 	if ((pid = fork()) != 0) {
+		close_task_fds(&task);
+		free_task_lists(&task);
+
 		if (pid < 0) {
 			err("fork: %m");
+			send_command_response(conn, CMD_STATUS_FAILED, "command failed");
 			return -1;
 		}
 		return 0;
 	}
 
+	if (hdr.type == CMD_TASK_SUBMIT) {
+		if ((cpid = process_task(&task)) < 0)
+			goto answer;
+		goto wait;
+	}
+
 	while (1) {
 		task_t type = TASK_NONE;
-		struct cmd hdr = {};
 
-		if ((rc = xrecvmsg(conn, &hdr, sizeof(hdr))) < 0)
-			goto answer;
+		if (pending) {
+			pending = 0;
+		} else {
+			nfds = TASK_SUBMIT_MAX_FDS;
+
+			if ((rc = recv_cmd(conn, &hdr, fds, &nfds)) < 0)
+				goto answer;
+		}
+
+		if (nfds > 0 && hdr.type != CMD_TASK_SUBMIT) {
+			err("unexpected file descriptors for command: %d", hdr.type);
+			while (nfds > 0)
+				close(fds[--nfds]);
+		}
 
 		switch (hdr.type) {
 			case CMD_TASK_BEGIN:
@@ -279,6 +582,31 @@ caller_task(int conn)
 
 				goto wait;
 
+			case CMD_BATCH_BEGIN:
+				batch = 1;
+				break;
+
+			case CMD_BATCH_END:
+				rc = (batch && !failed) ? EXIT_SUCCESS : EXIT_FAILURE;
+				goto answer;
+
+			case CMD_TASK_SUBMIT:
+				if (batch) {
+					if (run_batch_task(conn, &hdr, fds, nfds, &task, &failed) < 0) {
+						rc = EXIT_FAILURE;
+						goto answer;
+					}
+					continue;
+				}
+
+				if (recv_task_submit(conn, &hdr, fds, nfds, &task) < 0 ||
+				    (cpid = process_task(&task)) < 0) {
+					rc = EXIT_FAILURE;
+					goto answer;
+				}
+
+				goto wait;
+
 			default:
 				err("unsupported command: %d", hdr.type);
 		}
@@ -286,36 +614,9 @@ caller_task(int conn)
 		send_command_response(conn, CMD_STATUS_DONE, NULL);
 	}
 wait:
-	while (1) {
-		pid_t w;
-		int wstatus;
-
-		if ((w = waitpid(cpid, &wstatus, WUNTRACED | WCONTINUED)) < 0) {
-			err("waitpid: %m");
-			break;
-		}
-
-		if (WIFEXITED(wstatus)) {
-			rc = WEXITSTATUS(wstatus);
-			info("%s: process %d exited, status=%d", task2str(task.type), cpid, WEXITSTATUS(wstatus));
-			break;
-		}
-
-		if (WIFSIGNALED(wstatus)) {
-			info("%s: process %d killed by signal %d", task2str(task.type), cpid, WTERMSIG(wstatus));
-			break;
-		}
-	}
+	rc = wait_task(&task, cpid);
 answer:
-	if (task.env) {
-		free(task.env[0]);
-		free(task.env);
-	}
-
-	if (task.argv) {
-		free(task.argv[0]);
-		free(task.argv);
-	}
+	free_task_lists(&task);
 
 	/* Notify client about result */
 	(rc == EXIT_FAILURE)
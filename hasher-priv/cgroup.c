@@ -0,0 +1,653 @@
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mntent.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/sched.h>
+
+#include "cgroup.h"
+#include "logging.h"
+#include "priv.h"
+
+/*
+ * cgroup v2 hierarchy used by hasher-privd:
+ *
+ *   <base>/session-<uid>-<num>/server           session server and its helpers
+ *   <base>/session-<uid>-<num>/tasks/task-<pid> processes of a chrootuid task
+ *
+ * The base is the cgroup delegated to hasher-privd by the service
+ * manager, or /hasher-priv when it runs in the root cgroup. Session
+ * cgroups are delegated to the caller, so that tasks can create their
+ * own leaves, while limit files of the session stay owned by root and
+ * are written by the session server before it drops privileges.
+ * The "tasks" subtree is created by the caller, so it can be killed
+ * at once with cgroup.kill.
+ *
+ * Task processes close all inherited descriptors, so the session
+ * cgroup is passed to them by path.
+ *
+ * Processes are forked right into their leaves: moving a process
+ * between cgroups waits for an RCU grace period, which costs up to
+ * several milliseconds per task.
+ */
+
+static const char *const controllers[] = { "cpu", "io", "memory", "pids", NULL };
+
+static char base_path[PATH_MAX];
+static char session_path[PATH_MAX];
+static int base_fd = -1;
+static int tasks_fd = -1;
+static int in_leaf;		/* started by cgroup_fork() in a leaf */
+static int task_fd = -1;
+static char task_name[32];
+
+static int
+write_file(int dir_fd, const char *name, const char *value)
+{
+	size_t len = strlen(value);
+	ssize_t n;
+	int fd, errsv;
+
+	if ((fd = openat(dir_fd, name, O_WRONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	n = write(fd, value, len);
+	errsv = errno;
+	close(fd);
+
+	if (n != (ssize_t) len) {
+		errno = n < 0 ? errsv : EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+read_file(int dir_fd, const char *name, char *buf, size_t size)
+{
+	ssize_t n;
+	int fd, errsv;
+
+	if ((fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	n = read(fd, buf, size - 1);
+	errsv = errno;
+	close(fd);
+
+	if (n < 0) {
+		errno = errsv;
+		return -1;
+	}
+
+	buf[n] = '\0';
+	return 0;
+}
+
+static int
+open_dir(int dir_fd, const char *name)
+{
+	if (mkdirat(dir_fd, name, 0755) < 0 && errno != EEXIST)
+		return -1;
+
+	return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* Move the calling process into the cgroup NAME under DIR_FD. */
+static int
+enter_dir(int dir_fd, const char *name)
+{
+	int fd, rc;
+
+	if ((fd = open_dir(dir_fd, name)) < 0)
+		return -1;
+
+	rc = write_file(fd, "cgroup.procs", "0");
+	close(fd);
+
+	return rc;
+}
+
+/* Enable available controllers of interest for children of DIR_FD. */
+static int
+enable_controllers(int dir_fd)
+{
+	char buf[256], word[32], *p;
+	int i, n;
+
+	if (read_file(dir_fd, "cgroup.controllers", buf, sizeof(buf)) < 0)
+		return -1;
+
+	for (p = buf; sscanf(p, "%30s%n", word + 1, &n) == 1; p += n) {
+		for (i = 0; controllers[i]; i++)
+			if (!strcmp(controllers[i], word + 1))
+				break;
+
+		if (!controllers[i])
+			continue;
+
+		word[0] = '+';
+		if (write_file(dir_fd, "cgroup.subtree_control", word) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+find_root(char *path, size_t size)
+{
+	struct mntent *m;
+	char line[PATH_MAX + 8], *own = NULL;
+	FILE *fp;
+	int rc = -1;
+
+	if (!(fp = setmntent("/proc/self/mounts", "r")))
+		return -1;
+
+	while ((m = getmntent(fp)))
+		if (!strcmp(m->mnt_type, "cgroup2"))
+			break;
+
+	if (m)
+		rc = snprintf(path, size, "%s", m->mnt_dir);
+	endmntent(fp);
+
+	if (rc < 0 || (size_t) rc >= size) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (!(fp = fopen("/proc/self/cgroup", "re")))
+		return -1;
+
+	while (fgets(line, sizeof(line), fp))
+		if (!strncmp(line, "0::", 3)) {
+			own = line + 3;
+			own[strcspn(own, "\n")] = '\0';
+			break;
+		}
+	fclose(fp);
+
+	if (!own) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (strcmp(own, "/"))
+		strncat(path, own, size - strlen(path) - 1);
+
+	return strcmp(own, "/") ? 1 : 0;
+}
+
+int
+cgroup_init(void)
+{
+	char path[PATH_MAX];
+	int fd, delegated;
+
+	if ((delegated = find_root(path, sizeof(path))) < 0) {
+		info("cgroup: cgroup2 hierarchy not found, support disabled");
+		return -1;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		info("cgroup: %s: %m, support disabled", path);
+		return -1;
+	}
+
+	if (delegated) {
+		/*
+		 * Processes are allowed only in leaves of a delegated
+		 * subtree, step aside to let sessions have controllers.
+		 */
+		if (enter_dir(fd, "daemon") < 0) {
+			info("cgroup: %s/daemon: %m, support disabled", path);
+			close(fd);
+			return -1;
+		}
+		base_fd = fd;
+		snprintf(base_path, sizeof(base_path), "%s", path);
+	} else {
+		(void) enable_controllers(fd);
+
+		base_fd = open_dir(fd, PROJECT);
+		close(fd);
+
+		if (base_fd < 0) {
+			info("cgroup: %s/%s: %m, support disabled", path, PROJECT);
+			return -1;
+		}
+		snprintf(base_path, sizeof(base_path), "%s/%s", path, PROJECT);
+	}
+
+	if (enable_controllers(base_fd) < 0) {
+		info("cgroup: %s: unable to enable controllers: %m, support disabled", path);
+		close(base_fd);
+		base_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the leaf for the session server of UID:NUM, to be passed
+ * to cgroup_fork(), or -1 if it is not available.
+ */
+int
+cgroup_session_leaf(uid_t uid, unsigned num)
+{
+	char name[64];
+	int fd, leaf;
+
+	if (base_fd < 0)
+		return -1;
+
+	snprintf(name, sizeof(name), "session-%u-%u", uid, num);
+
+	if ((fd = open_dir(base_fd, name)) < 0) {
+		err("cgroup: %s: %m", name);
+		return -1;
+	}
+
+	if ((leaf = open_dir(fd, "server")) < 0)
+		err("cgroup: %s/server: %m", name);
+
+	close(fd);
+	return leaf;
+}
+
+static pid_t
+sys_clone3_into(int cgroup_fd)
+{
+#if defined(__NR_clone3) && defined(CLONE_INTO_CGROUP)
+	struct clone_args args = {
+		.flags = CLONE_INTO_CGROUP,
+		.exit_signal = SIGCHLD,
+		.cgroup = (__u64) cgroup_fd,
+	};
+
+	return (pid_t) syscall(__NR_clone3, &args, sizeof(args));
+#else
+	(void) cgroup_fd;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * Fork a child which starts in the cgroup CGROUP_FD, or just fork if
+ * CGROUP_FD is -1. Unlike fork(), clone3() leaves the thread id cached
+ * by libc stale in the child; it is not used by these single-threaded
+ * processes.
+ */
+pid_t
+cgroup_fork(int cgroup_fd)
+{
+	pid_t pid;
+
+	if (cgroup_fd < 0) {
+		if ((pid = fork()) == 0)
+			in_leaf = 0;
+		return pid;
+	}
+
+	if ((pid = sys_clone3_into(cgroup_fd)) < 0) {
+		if (errno != ENOSYS && errno != EINVAL && errno != E2BIG)
+			return -1;
+
+		/* Kernel is too old, join the cgroup after fork. */
+		if ((pid = fork()) == 0 && write_file(cgroup_fd, "cgroup.procs", "0") < 0) {
+			err("cgroup: unable to join the cgroup: %m");
+			_exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pid == 0)
+		in_leaf = 1;
+
+	return pid;
+}
+
+int
+cgroup_session_create(uid_t uid, gid_t gid, unsigned num)
+{
+	static const char *const delegate[] = {
+		"cgroup.procs", "cgroup.threads", "cgroup.subtree_control", NULL
+	};
+	cgroup_limit_t *p;
+	char name[64];
+	int fd, i;
+
+	if (base_fd < 0)
+		return 0;
+
+	/* Tasks could not be moved out of the daemon's cgroup. */
+	if (!in_leaf) {
+		close(base_fd);
+		base_fd = -1;
+		return 0;
+	}
+
+	snprintf(name, sizeof(name), "session-%u-%u", uid, num);
+
+	if ((fd = open_dir(base_fd, name)) < 0) {
+		err("cgroup: %s: %m", name);
+		goto fail;
+	}
+
+	if (enable_controllers(fd) < 0) {
+		err("cgroup: %s: unable to enable controllers: %m", name);
+		goto fail;
+	}
+
+	if (fchownat(fd, "", uid, gid, AT_EMPTY_PATH) < 0) {
+		err("cgroup: fchownat: %s: %m", name);
+		goto fail;
+	}
+
+	for (i = 0; delegate[i]; i++)
+		if (fchownat(fd, delegate[i], uid, gid, 0) < 0) {
+			err("cgroup: fchownat: %s/%s: %m", name, delegate[i]);
+			goto fail;
+		}
+
+	/* Written later by cgroup_set_limits() without privileges. */
+	for (p = cgroup_limits; p->name; ++p)
+		p->fd = openat(fd, p->file, O_WRONLY | O_CLOEXEC);
+
+	snprintf(session_path, sizeof(session_path), "%s/%s", base_path, name);
+
+	close(fd);
+	close(base_fd);
+	base_fd = -1;
+
+	return 0;
+fail:
+	if (fd >= 0)
+		close(fd);
+
+	close(base_fd);
+	base_fd = -1;
+
+	return -1;
+}
+
+int
+cgroup_set_limits(void)
+{
+	cgroup_limit_t *p;
+	int rc = 0;
+
+	for (p = cgroup_limits; p->name; ++p) {
+		char *value, *part, *saveptr = NULL;
+
+		if (p->value) {
+			if (p->fd < 0) {
+				err("cgroup: %s: limit cannot be applied", p->file);
+				rc = -1;
+				continue;
+			}
+
+			/* io.max takes one device per write. */
+			value = strdupa(p->value);
+
+			for (part = strtok_r(value, ",", &saveptr); part;
+			     part = strtok_r(NULL, ",", &saveptr)) {
+				if (write(p->fd, part, strlen(part)) < 0) {
+					err("cgroup: %s: %s: %m", p->file, part);
+					rc = -1;
+				}
+			}
+		}
+
+		if (p->fd >= 0)
+			close(p->fd);
+		p->fd = -1;
+	}
+
+	return rc;
+}
+
+/* Remove cgroup NAME and its descendants, DEPTH levels deep at most. */
+static int
+remove_tree(int dir_fd, const char *name, int depth)
+{
+	struct dirent *de;
+	DIR *dir;
+	int fd;
+
+	if (depth > 0 && (fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+		if (!(dir = fdopendir(fd))) {
+			close(fd);
+			return -1;
+		}
+
+		while ((de = readdir(dir)))
+			if (de->d_type == DT_DIR && de->d_name[0] != '.')
+				(void) remove_tree(fd, de->d_name, depth - 1);
+
+		closedir(dir);
+	}
+
+	return unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
+void
+cgroup_session_remove(uid_t uid, unsigned num)
+{
+	char name[64];
+
+	if (base_fd < 0)
+		return;
+
+	snprintf(name, sizeof(name), "session-%u-%u", uid, num);
+
+	/* Cgroups which still have processes are kept. */
+	if (remove_tree(base_fd, name, 2) < 0 && errno != ENOENT)
+		info("cgroup: %s: %m", name);
+}
+
+int
+cgroup_task_create(void)
+{
+	int fd;
+
+	if (!*session_path)
+		return 0;
+
+	if ((fd = open(session_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (mkdirat(fd, "tasks", 0755) == 0) {
+		/* Statistics of task leaves need controllers. */
+		tasks_fd = openat(fd, "tasks", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (tasks_fd >= 0)
+			(void) enable_controllers(tasks_fd);
+	} else if (errno == EEXIST) {
+		tasks_fd = openat(fd, "tasks", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	close(fd);
+
+	if (tasks_fd < 0)
+		return -1;
+
+	snprintf(task_name, sizeof(task_name), "task-%d", getpid());
+
+	if ((task_fd = open_dir(tasks_fd, task_name)) < 0)
+		return -1;
+
+	return 0;
+}
+
+pid_t
+cgroup_task_fork(void)
+{
+	return cgroup_fork(task_fd);
+}
+
+/*
+ * Kill all processes of chrootuid tasks of the session and wait until
+ * they are gone. Return 1 on success, 0 if cgroups are not available.
+ */
+int
+cgroup_kill_tasks(void)
+{
+	struct pollfd pfd = { .events = POLLPRI };
+	char buf[256], *p;
+	int fd, rc = -1, timeout = 10;
+	ssize_t n;
+
+	if (!*session_path)
+		return 0;
+
+	if ((fd = open(session_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return 0;
+
+	tasks_fd = openat(fd, "tasks", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	close(fd);
+
+	if (tasks_fd < 0)
+		return errno == ENOENT ? 1 : -1;
+
+	/* cgroup.kill also catches processes forked meanwhile. */
+	if (write_file(tasks_fd, "cgroup.kill", "1") < 0) {
+		if (errno == ENOENT)
+			rc = 0;
+		goto out;
+	}
+
+	if ((pfd.fd = openat(tasks_fd, "cgroup.events", O_RDONLY | O_CLOEXEC)) < 0)
+		goto out;
+
+	for (;;) {
+		if ((n = pread(pfd.fd, buf, sizeof(buf) - 1, 0)) < 0)
+			break;
+		buf[n] = '\0';
+
+		if ((p = strstr(buf, "populated ")) && p[10] == '0') {
+			rc = 1;
+			break;
+		}
+
+		if (!timeout--) {
+			errno = ETIMEDOUT;
+			break;
+		}
+
+		/* Changes of cgroup.events are reported as POLLPRI. */
+		if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+			break;
+	}
+
+	close(pfd.fd);
+out:
+	close(tasks_fd);
+	tasks_fd = -1;
+
+	return rc;
+}
+
+static void
+read_keys(int dir_fd, const char *name, const char *const *keys,
+	  unsigned long long *values, int *found)
+{
+	char buf[4096], *p, *line, *saveptr = NULL, *saveword;
+	int i;
+
+	if (read_file(dir_fd, name, buf, sizeof(buf)) < 0)
+		return;
+
+	*found = 1;
+
+	for (line = strtok_r(buf, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		/* io.stat lines are "MAJ:MIN key=value ...". */
+		for (p = strtok_r(line, " ", &saveword); p;
+		     p = strtok_r(NULL, " ", &saveword)) {
+			for (i = 0; keys[i]; i++) {
+				size_t len = strlen(keys[i]);
+				char *val;
+
+				if (strncmp(p, keys[i], len))
+					continue;
+
+				if (p[len] == '=')
+					val = p + len + 1;
+				else if (!p[len] && (val = strtok_r(NULL, " ", &saveword)))
+					;
+				else
+					continue;
+
+				values[i] += strtoull(val, NULL, 10);
+				break;
+			}
+		}
+	}
+}
+
+int
+cgroup_task_stat(struct cgroup_stat *st)
+{
+	static const char *const cpu_keys[] = { "usage_usec", "user_usec", "system_usec", NULL };
+	static const char *const mem_keys[] = { "anon", "file_mapped", NULL };
+	static const char *const io_keys[] = { "rbytes", "wbytes", NULL };
+	unsigned long long cpu[3] = {}, mem[2] = {}, io[2] = {};
+	char buf[32];
+	int found = 0;
+
+	if (task_fd < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	memset(st, 0, sizeof(*st));
+
+	read_keys(task_fd, "cpu.stat", cpu_keys, cpu, &found);
+	if (!found) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	st->usage_usec = cpu[0];
+	st->user_usec = cpu[1];
+	st->system_usec = cpu[2];
+
+	read_keys(task_fd, "memory.stat", mem_keys, mem, &st->has_memory);
+	st->memory_rss = mem[0] + mem[1];
+
+	if (st->has_memory && !read_file(task_fd, "memory.peak", buf, sizeof(buf)))
+		st->memory_peak = strtoull(buf, NULL, 10);
+
+	read_keys(task_fd, "io.stat", io_keys, io, &st->has_io);
+	st->io_rbytes = io[0];
+	st->io_wbytes = io[1];
+
+	return 0;
+}
+
+void
+cgroup_task_remove(void)
+{
+	if (task_fd < 0)
+		return;
+
+	close(task_fd);
+	task_fd = -1;
+
+	/* Fails with EBUSY if some processes are still there. */
+	(void) unlinkat(tasks_fd, task_name, AT_REMOVEDIR);
+}
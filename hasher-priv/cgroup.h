@@ -0,0 +1,37 @@
+#ifndef _CGROUP_H_
+#define _CGROUP_H_
+
+#include <sys/types.h>
+
+struct cgroup_stat {
+	unsigned long long usage_usec;	/* cpu.stat */
+	unsigned long long user_usec;
+	unsigned long long system_usec;
+	unsigned long long memory_rss;	/* memory.stat: anon + file_mapped */
+	unsigned long long memory_peak;	/* memory.peak, 0 if unknown */
+	unsigned long long io_rbytes;	/* io.stat, summed over devices */
+	unsigned long long io_wbytes;
+	int has_memory;
+	int has_io;
+};
+
+/* hasher-privd */
+int cgroup_init(void);
+int cgroup_session_leaf(uid_t uid, unsigned num);
+void cgroup_session_remove(uid_t uid, unsigned num);
+pid_t cgroup_fork(int cgroup_fd);
+
+/* session server */
+int cgroup_session_create(uid_t uid, gid_t gid, unsigned num);
+int cgroup_set_limits(void);
+
+/* chrootuid */
+int cgroup_task_create(void);
+pid_t cgroup_task_fork(void);
+int cgroup_task_stat(struct cgroup_stat *st);
+void cgroup_task_remove(void);
+
+/* killuid */
+int cgroup_kill_tasks(void);
+
+#endif /* _CGROUP_H_ */
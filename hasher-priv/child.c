@@ -55,12 +55,17 @@ connect_fds(int pty_fd, int pipe_out, int pipe_err)
 		if (isatty(STDIN_FILENO))
 			nullify_stdin();
 	}
-	if (dup2((use_pty ? pty_fd : pipe_out), STDOUT_FILENO) < 0)
-		error(EXIT_FAILURE, errno, "dup2(%d, %d)",
-		      (use_pty ? pty_fd : pipe_out), STDOUT_FILENO);
-	if (dup2((use_pty ? pty_fd : pipe_err), STDERR_FILENO) < 0)
-		error(EXIT_FAILURE, errno, "dup2(%d, %d)",
-		      (use_pty ? pty_fd : pipe_err), STDERR_FILENO);
+	/* Without pipes, stdout and stderr are caller's descriptors
+	   and are passed to the child as is. */
+	if (use_pty || pipe_out >= 0)
+	{
+		if (dup2((use_pty ? pty_fd : pipe_out), STDOUT_FILENO) < 0)
+			error(EXIT_FAILURE, errno, "dup2(%d, %d)",
+			      (use_pty ? pty_fd : pipe_out), STDOUT_FILENO);
+		if (dup2((use_pty ? pty_fd : pipe_err), STDERR_FILENO) < 0)
+			error(EXIT_FAILURE, errno, "dup2(%d, %d)",
+			      (use_pty ? pty_fd : pipe_err), STDERR_FILENO);
+	}
 
 	if (pty_fd > STDERR_FILENO)
 		close(pty_fd);
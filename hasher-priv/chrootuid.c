@@ -31,7 +31,9 @@
 #include <grp.h>
 #include <sys/socket.h>
 
+#include "cgroup.h"
 #include "priv.h"
+#include "usage.h"
 #include "xmalloc.h"
 
 static const char *program_subname = "chrootuid";
@@ -43,6 +45,47 @@ print_program_subname(void)
 		program_subname);
 }
 
+/*
+ * Child output goes through the parent only if something has to look
+ * at it: output based work limits are enforced by the relay, and
+ * caller's terminal must not be handed to the chroot.
+ */
+static int
+need_output_relay(void)
+{
+	return use_pty || x11_display
+		|| wlimit.bytes_written || wlimit.time_idle
+		|| isatty(STDOUT_FILENO) || isatty(STDERR_FILENO);
+}
+
+#define MSEC(usec) (usec) / 1000000, (usec) / 1000 % 1000
+
+static void
+print_task_usage(void)
+{
+	struct cgroup_stat st;
+
+	if (cgroup_task_stat(&st) < 0)
+	{
+		error(EXIT_SUCCESS, 0, "usage: not available");
+		return;
+	}
+
+	error(EXIT_SUCCESS, 0,
+	      "usage: cpu %llu.%03llus, user %llu.%03llus, system %llu.%03llus",
+	      MSEC(st.usage_usec), MSEC(st.user_usec),
+	      MSEC(st.system_usec));
+
+	if (st.has_memory)
+		error(EXIT_SUCCESS, 0, "usage: memory peak %llu bytes",
+		      st.memory_peak);
+
+	if (st.has_io)
+		error(EXIT_SUCCESS, 0,
+		      "usage: io read %llu bytes, written %llu bytes",
+		      st.io_rbytes, st.io_wbytes);
+}
+
 static int
 chrootuid(uid_t uid, gid_t gid, const char *ehome,
 	  const char *euser, const char *epath)
@@ -69,15 +112,17 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 	/* Check and sanitize file descriptors again. */
 	sanitize_fds();
 
-	/* Create pipes only if use_pty is not set. */
-	if (!use_pty && (pipe(pipe_out) || pipe(pipe_err)))
-		error(EXIT_FAILURE, errno, "pipe");
-
 	/* Create socketpair only if X11 forwarding is enabled. */
 	if (x11_prepare_connect() == EXIT_SUCCESS
 	    && socketpair(AF_UNIX, SOCK_STREAM, 0, ctl))
 		error(EXIT_FAILURE, errno, "socketpair AF_UNIX");
 
+	/* Create pipes only if use_pty is not set and child output
+	   has to be relayed. */
+	if (!use_pty && need_output_relay()
+	    && (pipe(pipe_out) || pipe(pipe_err)))
+		error(EXIT_FAILURE, errno, "pipe");
+
 	unshare_ipc();
 	unshare_uts();
 	if (!share_caller_network)
@@ -89,6 +134,14 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 	/* Always create pty, necessary for ioctl TIOCSCTTY in the child. */
 	master = open_pty(&slave, 0, 1);
 
+	/* CPU time and RSS of the child are read from /proc. */
+	if ((wlimit.time_cpu || wlimit.bytes_rss) && usage_init() < 0)
+		error(EXIT_FAILURE, errno, "/proc");
+
+	/* killuid relies on every child to be in a task cgroup. */
+	if (cgroup_task_create() < 0)
+		error(EXIT_FAILURE, errno, "cgroup");
+
 	if (chroot(".") < 0)
 		error(EXIT_FAILURE, errno, "chroot: %s", chroot_path);
 
@@ -111,7 +164,7 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 
 	block_signal_handler(SIGCHLD, SIG_BLOCK);
 
-	if ((pid = fork()) < 0)
+	if ((pid = cgroup_task_fork()) < 0)
 		error(EXIT_FAILURE, errno, "fork");
 
 	if (pid)
@@ -119,21 +172,27 @@ chrootuid(uid_t uid, gid_t gid, const char *ehome,
 		program_subname = "master";
 
 		if (close(slave)
-		    || (!use_pty
+		    || (pipe_out[1] >= 0
 			&& (close(pipe_out[1]) || close(pipe_err[1])))
 		    || (x11_display && close(ctl[1])))
 			error(EXIT_FAILURE, errno, "close");
 
 		/* Process is no longer privileged at this point. */
 
-		return handle_parent(pid, master, pipe_out[0], pipe_err[0],
-				     ctl[0]);
+		int     rc = handle_parent(pid, master, pipe_out[0],
+					   pipe_err[0], ctl[0]);
+
+		if (report_usage)
+			print_task_usage();
+		cgroup_task_remove();
+
+		return rc;
 	} else
 	{
 		program_subname = "slave";
 
 		if (close(master)
-		    || (!use_pty
+		    || (pipe_out[0] >= 0
 			&& (close(pipe_out[0]) || close(pipe_err[0])))
 		    || (x11_display && close(ctl[0])))
 			error(EXIT_FAILURE, errno, "close");
@@ -51,9 +51,14 @@ print_help(void)
 {
 	printf("Privileged helper for the hasher project.\n"
 	       "\nUsage: %s [options] <args>\n"
+	       "   or: %s [-<number>] --batch <file>\n"
 	       "\nValid options are:\n"
 	       "  -<number>:\n"
 	       "       subconfig identifier;\n"
+	       "  --batch <file>:\n"
+	       "       run tasks listed in file (\"-\" for stdin) over one session\n"
+	       "       connection, one task per line; a task prefixed with \"-\"\n"
+	       "       runs even if a preceding task failed;\n"
 	       "  --version:\n"
 	       "       print program version and exit.\n"
 	       "  -h or --help:\n"
@@ -81,7 +86,7 @@ print_help(void)
 	       "       mount appropriate file system to the given mount point;\n"
 	       "umount <chroot path>:\n"
 	       "       umount all previously mounted file systems.\n",
-	       program_invocation_short_name);
+	       program_invocation_short_name, program_invocation_short_name);
 	exit(EXIT_SUCCESS);
 }
 
@@ -103,6 +108,7 @@ const char **chroot_argv;
 unsigned caller_num;
 
 const char **task_args;
+const char *batch_file;
 
 static unsigned
 get_caller_num(const char *str)
@@ -133,7 +139,7 @@ parse_cmdline(int argc, const char *argv[])
 	ac = argc - 1;
 	av = argv + 1;
 
-	if (av[0][0] == '-')
+	if (av[0][0] == '-' && strcmp("--batch", av[0]))
 	{
 		/* option */
 		if (!strcmp("-h", av[0]) || !strcmp("--help", av[0]))
@@ -152,6 +158,14 @@ parse_cmdline(int argc, const char *argv[])
 
 	task_args = NULL;
 
+	if (!strcmp("--batch", av[0]))
+	{
+		if (ac != 2)
+			show_usage("%s: invalid usage", av[0]);
+		batch_file = av[1];
+		return TASK_NONE;
+	}
+
 	if (!strcmp("getconf", av[0]))
 	{
 		if (ac != 1)
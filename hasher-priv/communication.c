@@ -1,7 +1,9 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
@@ -89,6 +91,25 @@ send_list(int conn, cmd_t cmd, const char **argv)
 	return 0;
 }
 
+static void
+make_list(char *args, uint64_t datalen, char ***argv)
+{
+	size_t i = 0;
+	uint64_t n = 0;
+	char **av = NULL;
+
+	while (args && n < datalen) {
+		av = xrealloc(av, i + 1, sizeof(char *));
+		av[i++] = args + n;
+		n += strnlen(args + n, datalen - n) + 1;
+	}
+
+	av = xrealloc(av, (i + 1), sizeof(char *));
+	av[i] = NULL;
+
+	*argv = av;
+}
+
 int
 recv_list(int conn, uint64_t datalen, char ***argv)
 {
@@ -104,22 +125,107 @@ recv_list(int conn, uint64_t datalen, char ***argv)
 		return 0;
 	}
 
-	size_t i = 0;
+	make_list(args, datalen, argv);
+
+	return 0;
+}
+
+int
+pread_list(int fd, off_t offset, uint64_t datalen, char ***argv)
+{
+	char *args = xcalloc(1UL, datalen);
 	uint64_t n = 0;
-	char **av = NULL;
 
-	while (args && n < datalen) {
-		av = xrealloc(av, i + 1, sizeof(char *));
-		av[i++] = args + n;
-		n += strnlen(args + n, datalen - n) + 1;
+	while (n < datalen) {
+		ssize_t r = TEMP_FAILURE_RETRY(pread(fd, args + n, datalen - n, offset + (off_t) n));
+
+		if (r <= 0) {
+			if (r < 0)
+				err("pread: %m");
+			else
+				err("pread: unexpected EOF");
+			free(args);
+			return -1;
+		}
+
+		n += (uint64_t) r;
 	}
 
-	av = xrealloc(av, (i + 1), sizeof(char *));
-	av[i] = NULL;
+	make_list(args, datalen, argv);
 
-	*argv = av;
+	return 0;
+}
+
+/*
+ * Receive command header and file descriptors passed along with it.
+ * On entry *nfds is the capacity of FDS, on return it is the number of
+ * received descriptors.
+ */
+int
+recv_cmd(int conn, struct cmd *hdr, int *fds, size_t *nfds)
+{
+	ssize_t n;
+	size_t i, max_fds = *nfds;
+	struct cmsghdr *cmsg;
+
+	struct msghdr msg = {};
+	struct iovec iov  = {};
+
+	union {
+		struct cmsghdr cmh;
+		char   control[CMSG_SPACE(sizeof(int) * TASK_SUBMIT_MAX_FDS)];
+	} control_un;
+
+	*nfds = 0;
+
+	iov.iov_base = hdr;
+	iov.iov_len  = sizeof(*hdr);
+
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control_un.control;
+	msg.msg_controllen = sizeof(control_un.control);
+
+	if ((n = TEMP_FAILURE_RETRY(recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC))) <= 0) {
+		if (n < 0)
+			err("recvmsg: %m");
+		else
+			err("recvmsg: unexpected EOF");
+		return -1;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		size_t count;
+		int *p = (int *) (void *) CMSG_DATA(cmsg);
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for (i = 0; i < count; i++) {
+			if (*nfds < max_fds)
+				fds[(*nfds)++] = p[i];
+			else
+				close(p[i]);
+		}
+	}
+
+	if (msg.msg_flags & MSG_CTRUNC) {
+		err("recvmsg: too many descriptors");
+		goto fail;
+	}
+
+	if ((size_t) n < sizeof(*hdr) &&
+	    xrecvmsg(conn, (char *) hdr + n, sizeof(*hdr) - (size_t) n) < 0)
+		goto fail;
 
 	return 0;
+fail:
+	for (i = 0; i < *nfds; i++)
+		close(fds[i]);
+	*nfds = 0;
+	return -1;
 }
 
 int
@@ -265,6 +371,214 @@ recv_command_response(int conn, cmd_status_t *retcode, char **m)
 	return 0;
 }
 
+static uint64_t
+list_size(const char **argv)
+{
+	uint64_t len = 0;
+
+	while (argv && *argv)
+		len += strlen(*argv++) + 1;
+
+	return len;
+}
+
+static char *
+list_copy(char *p, const char **argv)
+{
+	while (argv && *argv) {
+		size_t len = strlen(*argv) + 1;
+
+		memcpy(p, *argv++, len);
+		p += len;
+	}
+
+	return p;
+}
+
+/* Payloads larger than this are passed in a sealed memfd. */
+#define TASK_SUBMIT_INLINE_MAX (64 * 1024)
+
+static int
+payload_memfd(const char *data, size_t len)
+{
+#ifdef MFD_ALLOW_SEALING
+	int fd;
+
+	if ((fd = memfd_create("hasher-priv-task", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+		return -1;
+
+	if (write_loop(fd, data, len) != (ssize_t) len ||
+	    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	(void) data;
+	(void) len;
+	return -1;
+#endif
+}
+
+static int
+send_task_submit(int conn, task_t task, uint32_t flags, const char **argv, const char **env)
+{
+	int rc = -1;
+	int fds[TASK_SUBMIT_MAX_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, -1 };
+	size_t nfds = 3, len;
+	ssize_t n;
+	char *payload;
+
+	struct cmd hdr = {};
+	struct task_submit ts = {};
+	struct iovec iov[3];
+	struct msghdr mh = {};
+	struct cmsghdr *cmsg;
+
+	union {
+		struct cmsghdr cmh;
+		char   control[CMSG_SPACE(sizeof(fds))];
+	} control_un;
+
+	ts.version = PROTOCOL_VERSION;
+	ts.type    = task;
+	ts.flags   = flags & ~(uint32_t) TASK_SUBMIT_MEMFD;
+	ts.argvlen = list_size(argv);
+	ts.envlen  = list_size(env);
+
+	len = (size_t) (ts.argvlen + ts.envlen);
+	payload = xmalloc(len ? len : 1UL);
+	list_copy(list_copy(payload, argv), env);
+
+	hdr.type    = CMD_TASK_SUBMIT;
+	hdr.datalen = sizeof(ts) + len;
+
+	if (len > TASK_SUBMIT_INLINE_MAX && (fds[3] = payload_memfd(payload, len)) >= 0) {
+		ts.flags   |= TASK_SUBMIT_MEMFD;
+		hdr.datalen = sizeof(ts);
+		nfds++;
+		len = 0;
+	}
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len  = sizeof(hdr);
+	iov[1].iov_base = &ts;
+	iov[1].iov_len  = sizeof(ts);
+	iov[2].iov_base = payload;
+	iov[2].iov_len  = len;
+
+	mh.msg_iov        = iov;
+	mh.msg_iovlen     = 3;
+	mh.msg_control    = control_un.control;
+	mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+	if ((n = TEMP_FAILURE_RETRY(sendmsg(conn, &mh, 0))) != (ssize_t) (sizeof(hdr) + sizeof(ts) + len)) {
+		if (n < 0)
+			err("sendmsg: %m");
+		else
+			err("sendmsg: expected size %u, got %u",
+			    (unsigned) (sizeof(hdr) + sizeof(ts) + len), (unsigned) n);
+		goto out;
+	}
+
+	rc = 0;
+out:
+	if (fds[3] >= 0)
+		close(fds[3]);
+	free(payload);
+
+	return rc;
+}
+
+static int
+recv_task_status(int conn)
+{
+	cmd_status_t status;
+	char *msg = NULL;
+
+	if (recv_command_response(conn, &status, &msg) < 0) {
+		free(msg);
+		return -1;
+	}
+
+	/* Output of tasks answered by the session server itself */
+	if (msg && *msg) {
+		if (status == CMD_STATUS_FAILED)
+			err("%s", msg);
+		else
+			fputs(msg, stdout);
+	}
+
+	free(msg);
+
+	return (status == CMD_STATUS_FAILED) ? -1 : 0;
+}
+
+int
+server_task_submit(int conn, task_t task, const char **argv, const char **env)
+{
+	if (send_task_submit(conn, task, 0, argv, env) < 0)
+		return -1;
+
+	return recv_task_status(conn);
+}
+
+/*
+ * Send all tasks of the batch at once and collect their statuses
+ * afterwards. The session server answers every command in order:
+ * CMD_BATCH_BEGIN, each task and CMD_BATCH_END which carries
+ * the status of the whole batch.
+ */
+int
+server_task_batch(int conn, const struct batch_task *tasks, size_t ntasks, const char **env)
+{
+	int rc = 0;
+	size_t i;
+
+	if (send_list(conn, CMD_BATCH_BEGIN, NULL) < 0)
+		return -1;
+
+	for (i = 0; i < ntasks; i++) {
+		if (send_task_submit(conn, tasks[i].type, tasks[i].flags, tasks[i].argv, env) < 0)
+			return -1;
+	}
+
+	if (send_list(conn, CMD_BATCH_END, NULL) < 0)
+		return -1;
+
+	if (recv_task_status(conn) < 0)
+		return -1;
+
+	for (i = 0; i < ntasks; i++) {
+		cmd_status_t status;
+		char *msg = NULL;
+
+		if (recv_command_response(conn, &status, &msg) < 0) {
+			free(msg);
+			return -1;
+		}
+
+		if (status == CMD_STATUS_FAILED)
+			err("task %zu: %s", i + 1, (msg && *msg) ? msg : "failed");
+		else if (msg)
+			fputs(msg, stdout);
+
+		free(msg);
+	}
+
+	if (recv_task_status(conn) < 0)
+		rc = -1;
+
+	return rc;
+}
+
 int
 server_command(int conn, cmd_t cmd, const char **args)
 {
@@ -287,10 +601,14 @@ server_command(int conn, cmd_t cmd, const char **args)
 	return status == CMD_STATUS_FAILED ? -1 : 0;
 }
 
+/*
+ * Open session and return the connection to the session server
+ * received from hasher-privd.
+ */
 int
 server_open_session(const char *dir_name, const char *file_name, unsigned num)
 {
-	int conn;
+	int conn, fd = -1;
 	cmd_status_t status;
 	struct cmd hdr = {};
 	char *msg = NULL;
@@ -312,6 +630,9 @@ server_open_session(const char *dir_name, const char *file_name, unsigned num)
 		return -1;
 	}
 
+	if (status != CMD_STATUS_FAILED && recv_fds(conn, sizeof(fd), &fd) < 0)
+		fd = -1;
+
 	close(conn);
 
 	if (msg && *msg) {
@@ -319,7 +640,7 @@ server_open_session(const char *dir_name, const char *file_name, unsigned num)
 		free(msg);
 	}
 
-	return status == CMD_STATUS_FAILED ? -1 : 0;
+	return status == CMD_STATUS_FAILED ? -1 : fd;
 }
 
 int
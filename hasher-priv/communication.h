@@ -1,6 +1,7 @@
 #ifndef _PROTO_H_
 #define _PROTO_H_
 
+#include <sys/types.h>
 #include <stdint.h>
 
 typedef enum {
@@ -17,6 +18,11 @@ typedef enum {
 	CMD_TASK_ENVIRON,
 	CMD_TASK_RUN,
 
+	/* Session commands, protocol version 2 */
+	CMD_TASK_SUBMIT,
+	CMD_BATCH_BEGIN,
+	CMD_BATCH_END,
+
 } cmd_t;
 
 typedef enum {
@@ -29,6 +35,36 @@ struct cmd {
 	uint64_t datalen;
 };
 
+/*
+ * Protocol version 2 submits the whole task in one CMD_TASK_SUBMIT
+ * message: the header is followed by struct task_submit, the argument
+ * list and the environment list (both as sequences of NUL-terminated
+ * strings). The message carries client's stdin, stdout and stderr
+ * as SCM_RIGHTS. If the lists are too large, they are passed in
+ * a sealed memfd sent as the fourth descriptor instead.
+ */
+#define PROTOCOL_VERSION 2
+
+#define TASK_SUBMIT_MEMFD 1
+
+/*
+ * Within a batch, tasks depend on all the preceding ones and are
+ * skipped once a task fails. An independent task runs regardless
+ * of earlier failures and its own failure does not stop the batch.
+ */
+#define TASK_SUBMIT_INDEPENDENT 2
+
+#define TASK_SUBMIT_MAX_FDS 4
+
+struct task_submit {
+	uint32_t version;
+	uint32_t type;
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t argvlen;
+	uint64_t envlen;
+};
+
 typedef enum {
 	TASK_NONE = 0,
 	TASK_GETCONF,
@@ -44,11 +80,19 @@ typedef enum {
 	TASK_UMOUNT
 } task_t;
 
+struct batch_task {
+	task_t type;
+	uint32_t flags;
+	const char **argv;
+};
+
 char *task2str(task_t type);
 task_t str2task(char *s);
 
+int recv_cmd(int conn, struct cmd *hdr, int *fds, size_t *nfds);
 int recv_fds(int conn, uint64_t datalen, int *fds);
 int recv_list(int conn, uint64_t datalen, char ***argv);
+int pread_list(int fd, off_t offset, uint64_t datalen, char ***argv);
 
 long int send_command_response(int conn, int retcode, const char *fmt, ...);
 
@@ -58,6 +102,8 @@ int server_close_session(const char *dir_name, const char *file_name, unsigned c
 
 int server_task(int conn, task_t task);
 int server_task_fds(int conn);
+int server_task_submit(int conn, task_t task, const char **argv, const char **env);
+int server_task_batch(int conn, const struct batch_task *tasks, size_t ntasks, const char **env);
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -49,10 +49,14 @@ uid_t   change_uid1, change_uid2;
 gid_t   change_gid1, change_gid2;
 gid_t   server_gid;
 unsigned long server_session_timeout = 0;
+unsigned long server_listen_backlog = 128;
+prefork_t *server_prefork;
+size_t  server_prefork_size;
 mode_t  change_umask = 022;
 int change_nice = 8;
 int     allow_tty_devices, use_pty;
 size_t  x11_data_len;
+size_t  relay_buffer_size = 65536;
 int share_caller_network = 0;
 int share_ipc = -1;
 int share_mount = -1;
@@ -120,6 +124,26 @@ change_rlimit_t change_rlimit[] = {
 
 work_limit_t wlimit;
 
+cgroup_limit_t cgroup_limits[] = {
+
+/* Memory usage hard limit, in bytes.  */
+	{"memory_max", "memory.max", 0, -1},
+
+/* CPU bandwidth, "$MAX $PERIOD" in microseconds.  */
+	{"cpu_max", "cpu.max", 0, -1},
+
+/* Number of processes.  */
+	{"pids_max", "pids.max", 0, -1},
+
+/* Per-device IO limits, "$MAJ:$MIN rbps=... wbps=...".  */
+	{"io_max", "io.max", 0, -1},
+
+/* End of limits.  */
+	{0, 0, 0, -1}
+};
+
+int     report_usage;
+
 static void __attribute__ ((noreturn))
 bad_option_name(const char *optname, const char *filename)
 {
@@ -168,6 +192,23 @@ str2nice(const char *name, const char *value, const char *filename)
 	return (int) n;
 }
 
+static size_t
+str2bufsize(const char *name, const char *value, const char *filename)
+{
+	char   *p = 0;
+	unsigned long n;
+
+	if (!*value)
+		bad_option_value(name, value, filename);
+
+	errno = 0;
+	n = strtoul(value, &p, 10);
+	if (!p || *p || errno == ERANGE || n < BUFSIZ || n > 64UL * 1024 * 1024)
+		bad_option_value(name, value, filename);
+
+	return (size_t) n;
+}
+
 static  rlim_t
 str2rlim(const char *name, const char *value, const char *filename)
 {
@@ -262,14 +303,38 @@ parse_wlim(const char *name, const char *value,
 		pval = &wlimit.time_elapsed;
 	else if (!strcasecmp("time_idle", name))
 		pval = &wlimit.time_idle;
+	else if (!strcasecmp("time_cpu", name))
+		pval = &wlimit.time_cpu;
 	else if (!strcasecmp("bytes_written", name))
 		pval = &wlimit.bytes_written;
+	else if (!strcasecmp("bytes_rss", name))
+		pval = &wlimit.bytes_rss;
 	else
 		bad_option_name(optname, filename);
 
 	modify_wlim(pval, value, optname, filename, 1);
 }
 
+static void
+parse_cgroup(const char *name, const char *value,
+	     const char *optname, const char *filename)
+{
+	cgroup_limit_t *p;
+
+	for (p = cgroup_limits; p->name; ++p)
+		if (!strcasecmp(p->name, name))
+			break;
+
+	if (!p->name)
+		bad_option_name(optname, filename);
+
+	if (strchr(value, '\n'))
+		bad_option_value(optname, value, filename);
+
+	free((char *) p->value);
+	p->value = *value ? xstrdup(value) : 0;
+}
+
 static const char *
 parse_mountpoints(const char *value, const char *filename)
 {
@@ -369,6 +434,7 @@ set_config(const char *name, const char *value, const char *filename)
 {
 	const char rlim_prefix[] = "rlimit_";
 	const char wlim_prefix[] = "wlimit_";
+	const char cgroup_prefix[] = "cgroup_";
 
 	if (!strcasecmp("user1", name))
 	{
@@ -390,12 +456,17 @@ set_config(const char *name, const char *value, const char *filename)
 		allowed_mountpoints = parse_mountpoints(value, filename);
 	} else if (!strcasecmp("allow_ttydev", name))
 		allow_tty_devices = str2bool(name, value, filename);
+	else if (!strcasecmp("relay_buffer_size", name))
+		relay_buffer_size = str2bufsize(name, value, filename);
 	else if (!strncasecmp(rlim_prefix, name, sizeof(rlim_prefix) - 1))
 		parse_rlim(name + sizeof(rlim_prefix) - 1, value, name,
 			   filename);
 	else if (!strncasecmp(wlim_prefix, name, sizeof(wlim_prefix) - 1))
 		parse_wlim(name + sizeof(wlim_prefix) - 1, value, name,
 			   filename);
+	else if (!strncasecmp(cgroup_prefix, name, sizeof(cgroup_prefix) - 1))
+		parse_cgroup(name + sizeof(cgroup_prefix) - 1, value, name,
+			     filename);
 	else
 		bad_option_name(name, filename);
 }
@@ -583,10 +654,21 @@ parse_env(void)
 		modify_wlim(&wlimit.time_idle, e, "wlimit_time_idle",
 			    "environment", 0);
 
+	if ((e = getenv("wlimit_time_cpu")) && *e)
+		modify_wlim(&wlimit.time_cpu, e, "wlimit_time_cpu",
+			    "environment", 0);
+
 	if ((e = getenv("wlimit_bytes_written")) && *e)
 		modify_wlim(&wlimit.bytes_written, e, "wlimit_bytes_written",
 			    "environment", 0);
 
+	if ((e = getenv("wlimit_bytes_rss")) && *e)
+		modify_wlim(&wlimit.bytes_rss, e, "wlimit_bytes_rss",
+			    "environment", 0);
+
+	if ((e = getenv("report_usage")))
+		report_usage = str2bool("report_usage", e, "environment");
+
 	if ((e = getenv("use_pty")))
 		use_pty = str2bool("use_pty", e, "environment");
 
@@ -653,6 +735,49 @@ check_server_controlgroup(void)
 	server_gid = gr->gr_gid;
 }
 
+/*
+ * Parse list of USER[:COUNT] entries: for each USER, session servers
+ * for subconfigs 0..COUNT-1 are started in advance.
+ */
+static void
+parse_prefork(const char *name, const char *value, const char *filename)
+{
+	char   *entries = xstrdup(value);
+	char   *entry = strtok(entries, " \t,");
+
+	for (; entry; entry = strtok(0, " \t,"))
+	{
+		char   *count = strchr(entry, ':');
+		prefork_t *p;
+
+		if (count)
+			*count++ = '\0';
+
+		if (!*entry)
+			bad_option_value(name, value, filename);
+
+		server_prefork = xrealloc(server_prefork,
+					  server_prefork_size + 1,
+					  sizeof(*server_prefork));
+		p = &server_prefork[server_prefork_size++];
+
+		p->user = xstrdup(entry);
+		p->uid = (uid_t) -1;
+		p->count = 1;
+
+		if (count)
+		{
+			unsigned long n = str2ul(name, count, filename);
+
+			if (!n || n > INT_MAX)
+				bad_option_value(name, value, filename);
+			p->count = (unsigned) n;
+		}
+	}
+
+	free(entries);
+}
+
 static void
 set_server_config(const char *name, const char *value, const char *filename)
 {
@@ -660,11 +785,19 @@ set_server_config(const char *name, const char *value, const char *filename)
 		server_log_priority = logging_level(value);
 	else if (!strcasecmp("session_timeout", name))
 		server_session_timeout = str2ul(name, value, filename);
+	else if (!strcasecmp("listen_backlog", name))
+	{
+		server_listen_backlog = str2ul(name, value, filename);
+		if (!server_listen_backlog || server_listen_backlog > INT_MAX)
+			bad_option_value(name, value, filename);
+	}
 	else if (!strcasecmp("pidfile", name))
 	{
 		free((char *) server_pidfile);
 		server_pidfile = xstrdup(value);
-	} else if (!strcasecmp("controlgroup", name))
+	} else if (!strcasecmp("prefork", name))
+		parse_prefork(name, value, filename);
+	else if (!strcasecmp("controlgroup", name))
 	{
 		free((char *) server_controlgroup);
 		server_controlgroup = xstrdup(value);
@@ -26,8 +26,10 @@
 #include <paths.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <linux/limits.h>
 #include <limits.h>
+#include <dirent.h>
 
 #include "priv.h"
 
@@ -46,12 +48,86 @@ get_open_max(void)
 	return (int) i;
 }
 
+#ifndef CLOSE_RANGE_CLOEXEC
+# define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+static int
+sys_close_range(unsigned int first, unsigned int last, unsigned int flags)
+{
+#ifdef __NR_close_range
+	return (int) syscall(__NR_close_range, first, last, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+typedef void (*fd_fn_t) (int);
+
+/*
+ * Call FN for every open descriptor starting from FIRST.
+ * Enumerate /proc/self/fd if possible, otherwise probe
+ * every descriptor up to get_open_max().
+ */
+static void
+for_each_fd(int first, fd_fn_t fn)
+{
+	DIR    *dir = opendir("/proc/self/fd");
+
+	if (dir)
+	{
+		struct dirent *ent;
+		int     dir_fd = dirfd(dir);
+
+		while ((ent = readdir(dir)))
+		{
+			char   *end;
+			long    fd = strtol(ent->d_name, &end, 10);
+
+			if (*end || end == ent->d_name ||
+			    fd < first || fd == dir_fd || fd > INT_MAX)
+				continue;
+
+			fn((int) fd);
+		}
+
+		closedir(dir);
+		return;
+	}
+
+	int     fd, max_fd = get_open_max();
+
+	for (fd = first; fd < max_fd; ++fd)
+		fn(fd);
+}
+
+static void
+close_fd(int fd)
+{
+	(void) close(fd);
+}
+
+static void
+cloexec_fd(int fd)
+{
+	int     flags = fcntl(fd, F_GETFD, 0);
+
+	if (flags < 0)
+		return;
+
+	int     newflags = flags | FD_CLOEXEC;
+
+	if (flags != newflags && fcntl(fd, F_SETFD, newflags))
+		error(EXIT_FAILURE, errno, "fcntl F_SETFD");
+}
+
 
 /* This function may be executed with root privileges. */
 void
 sanitize_fds(void)
 {
-	int     fd, max_fd;
+	int     fd;
 
 	/* Set safe umask, just in case. */
 	umask(077);
@@ -66,11 +142,9 @@ sanitize_fds(void)
 			exit(EXIT_FAILURE);
 	}
 
-	max_fd = get_open_max();
-
 	/* Close all the rest. */
-	for (; fd < max_fd; ++fd)
-		(void) close(fd);
+	if (sys_close_range((unsigned) fd, ~0U, 0) < 0)
+		for_each_fd(fd, close_fd);
 
 	errno = 0;
 }
@@ -79,21 +153,9 @@ sanitize_fds(void)
 void
 cloexec_fds(void)
 {
-	int     fd, max_fd = get_open_max();
-
 	/* Set close-on-exec flag on all non-standard descriptors. */
-	for (fd = STDERR_FILENO + 1; fd < max_fd; ++fd)
-	{
-		int     flags = fcntl(fd, F_GETFD, 0);
-
-		if (flags < 0)
-			continue;
-
-		int     newflags = flags | FD_CLOEXEC;
-
-		if (flags != newflags && fcntl(fd, F_SETFD, newflags))
-			error(EXIT_FAILURE, errno, "fcntl F_SETFD");
-	}
+	if (sys_close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC) < 0)
+		for_each_fd(STDERR_FILENO + 1, cloexec_fd);
 
 	errno = 0;
 }
@@ -162,22 +224,3 @@ write_loop(int fd, const char *buffer, size_t count)
 	}
 	return offset;
 }
-
-/* This function may be executed with caller privileges. */
-void
-fds_add_fd(fd_set *fds, int *max_fd, const int fd)
-{
-	if (fd < 0)
-		return;
-
-	FD_SET(fd, fds);
-	if (fd > *max_fd)
-		*max_fd = fd;
-}
-
-/* This function may be executed with caller privileges. */
-int
-fds_isset(fd_set *fds, const int fd)
-{
-	return (fd >= 0) && FD_ISSET(fd, fds);
-}
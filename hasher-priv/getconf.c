@@ -21,17 +21,31 @@
 /* Code in this file may be executed with root privileges. */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "priv.h"
+#include "xmalloc.h"
 
-int
-do_getconf(void)
+char   *
+getconf_output(void)
 {
+	char   *output;
+
 	if (caller_num)
-		printf("%s/%s:%u\n", "/etc/hasher-priv/user.d",
-		       caller_user, caller_num);
+		xasprintf(&output, "%s/%s:%u\n", "/etc/hasher-priv/user.d",
+			  caller_user, caller_num);
 	else
-		printf("%s/%s\n", "/etc/hasher-priv/user.d",
-		       caller_user);
+		xasprintf(&output, "%s/%s\n", "/etc/hasher-priv/user.d",
+			  caller_user);
+	return output;
+}
+
+int
+do_getconf(void)
+{
+	char   *output = getconf_output();
+
+	fputs(output, stdout);
+	free(output);
 	return 0;
 }
@@ -21,19 +21,45 @@
 /* Code in this file may be executed with root privileges. */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "priv.h"
+#include "xmalloc.h"
+
+char   *
+getugid1_output(void)
+{
+	char   *output;
+
+	xasprintf(&output, "%u:%u\n", change_uid1, change_gid1);
+	return output;
+}
+
+char   *
+getugid2_output(void)
+{
+	char   *output;
+
+	xasprintf(&output, "%u:%u\n", change_uid2, change_gid2);
+	return output;
+}
 
 int
 do_getugid1(void)
 {
-	printf("%u:%u\n", change_uid1, change_gid1);
+	char   *output = getugid1_output();
+
+	fputs(output, stdout);
+	free(output);
 	return 0;
 }
 
 int
 do_getugid2(void)
 {
-	printf("%u:%u\n", change_uid2, change_gid2);
+	char   *output = getugid2_output();
+
+	fputs(output, stdout);
+	free(output);
 	return 0;
 }
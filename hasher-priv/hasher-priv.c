@@ -20,7 +20,6 @@
 
 /* Code in this file may be executed with root privileges. */
 
-#include <sys/param.h> /* MAXPATHLEN */
 
 #include <errno.h>
 #include <error.h>
@@ -31,7 +30,7 @@
 
 #include "priv.h"
 #include "logging.h"
-#include "sockets.h"
+#include "xmalloc.h"
 #include "communication.h"
 
 static void
@@ -40,12 +39,114 @@ my_error_print_progname(void)
 	fprintf(stderr, "%s: ", program_invocation_short_name);
 }
 
+/*
+ * Split the line into words separated by blanks.
+ * A backslash escapes the following character.
+ */
+static const char **
+split_words(char *line, int *count)
+{
+	const char **words = NULL;
+	char *r = line, *w = line;
+	int n = 0;
+
+	while (1) {
+		char c;
+
+		while (*r == ' ' || *r == '\t')
+			r++;
+
+		if (!*r || *r == '\n')
+			break;
+
+		words = xrealloc(words, (size_t) n + 2, sizeof(*words));
+		words[n++] = w;
+
+		while (*r && *r != ' ' && *r != '\t' && *r != '\n') {
+			if (*r == '\\' && r[1] && r[1] != '\n')
+				r++;
+			*w++ = *r++;
+		}
+
+		c = *r;
+		*w++ = '\0';
+		if (c)
+			r++;
+	}
+
+	if (words)
+		words[n] = NULL;
+
+	*count = n;
+	return words;
+}
+
+/*
+ * Read the batch file: one task per line in the same form as
+ * on the command line. Empty lines and lines starting with '#'
+ * are ignored.
+ */
+static struct batch_task *
+read_batch(const char *file, size_t *ntasks)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0, lineno = 0;
+	struct batch_task *tasks = NULL;
+
+	fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+	if (!fp)
+		error(EXIT_FAILURE, errno, "%s", file);
+
+	*ntasks = 0;
+
+	while (getline(&line, &size, fp) >= 0) {
+		const char **words, **args;
+		uint32_t flags = 0;
+		int n;
+
+		lineno++;
+
+		if (!(words = split_words(xstrdup(line), &n)) || words[0][0] == '#')
+			continue;
+
+		if (words[0][0] == '-') {
+			flags |= TASK_SUBMIT_INDEPENDENT;
+			words[0]++;
+		}
+
+		if (!*words[0] || *words[0] == '-')
+			error(EXIT_FAILURE, 0, "%s:%zu: invalid task", file, lineno);
+
+		args = xcalloc((size_t) n + 2, sizeof(*args));
+		args[0] = program_invocation_short_name;
+		memcpy(args + 1, words, (size_t) n * sizeof(*args));
+		free(words);
+
+		tasks = xrealloc(tasks, *ntasks + 1, sizeof(*tasks));
+		tasks[*ntasks].type  = parse_cmdline(n + 1, args);
+		tasks[*ntasks].flags = flags;
+		tasks[*ntasks].argv  = task_args;
+		(*ntasks)++;
+	}
+
+	if (ferror(fp))
+		error(EXIT_FAILURE, errno, "%s", file);
+
+	if (fp != stdin)
+		fclose(fp);
+	free(line);
+
+	return tasks;
+}
+
 int
 main(int ac, const char *av[], const char *ev[])
 {
 	int conn;
 	task_t  task;
-	char socketname[MAXPATHLEN];
+	struct batch_task *tasks = NULL;
+	size_t ntasks = 0;
 
 	error_print_progname = my_error_print_progname;
 
@@ -55,30 +156,22 @@ main(int ac, const char *av[], const char *ev[])
 	/* Second, parse command line arguments. */
 	task = parse_cmdline(ac, av);
 
-	/* Connect to remote server and open session. */
-	if (server_open_session(SOCKETDIR, PROJECT, caller_num) < 0)
-		return EXIT_FAILURE;
-
-	/* Open user session */
-	snprintf(socketname, sizeof(socketname), "hasher-priv-%d-%u", geteuid(), caller_num);
+	if (batch_file)
+		tasks = read_batch(batch_file, &ntasks);
 
-	if ((conn = unix_connect(SOCKETDIR, socketname)) < 0)
+	/* Connect to remote server and receive connection to the session. */
+	if ((conn = server_open_session(SOCKETDIR, PROJECT, caller_num)) < 0)
 		return EXIT_FAILURE;
 
-	if (server_task(conn, task) < 0)
-		return EXIT_FAILURE;
-
-	if (server_task_fds(conn) < 0)
-		return EXIT_FAILURE;
-
-	if (server_command(conn, CMD_TASK_ARGUMENTS, task_args) < 0)
-		return EXIT_FAILURE;
-
-	if (server_command(conn, CMD_TASK_ENVIRON, ev) < 0)
-		return EXIT_FAILURE;
-
-	if (server_command(conn, CMD_TASK_RUN, NULL) < 0)
-		return EXIT_FAILURE;
+	if (batch_file) {
+		/* Run all tasks of the batch over this connection. */
+		if (server_task_batch(conn, tasks, ntasks, ev) < 0)
+			return EXIT_FAILURE;
+	} else {
+		/* Submit the task with its descriptors, arguments and environment at once. */
+		if (server_task_submit(conn, task, task_args, ev) < 0)
+			return EXIT_FAILURE;
+	}
 
 	/* Close session socket. */
 	close(conn);
@@ -8,116 +8,358 @@
 
 #include <errno.h>
 #include <error.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cgroup.h"
 #include "epoll.h"
 #include "logging.h"
+#include "pidfd.h"
 #include "pidfile.h"
+#include "session.h"
+#include "xmalloc.h"
 #include "sockets.h"
 #include "communication.h"
 #include "priv.h"
 
-struct session {
-	struct session *next;
+static int finish_server = 0;
+static int fd_ep = -1;
+
+unsigned caller_num;
+
+/*
+ * Warm session servers which exit sooner than this after start
+ * are not respawned to avoid a fork loop on broken configs.
+ */
+#define PREFORK_MIN_LIFETIME 10
+
+static time_t
+monotonic_time(void)
+{
+	struct timespec ts;
 
-	uid_t caller_uid;
-	gid_t caller_gid;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		fatal("clock_gettime: %m");
 
-	unsigned caller_num;
+	return ts.tv_sec;
+}
 
+static int
+spawn_session(int conn, int *pair, uid_t uid, gid_t gid, unsigned num)
+{
+	int pidfd, ctl;
 	pid_t server_pid;
-};
+	struct session *e;
 
-static int finish_server = 0;
-static struct session *pool = NULL;
+	if ((server_pid = fork_server(conn, pair, uid, gid, num, &ctl)) < 0)
+		return -1;
 
-unsigned caller_num;
+	e = session_insert(uid, gid, num, server_pid);
+	e->start_time = monotonic_time();
+
+	/* A stuck session server must not block the master. */
+	if (fcntl(ctl, F_SETFL, O_NONBLOCK) < 0)
+		err("fcntl: %m");
+
+	e->server_ctl = ctl;
+
+	/*
+	 * Track the session server by pidfd if possible, otherwise
+	 * rely on SIGCHLD only.
+	 */
+	if ((pidfd = sys_pidfd_open(server_pid, 0)) < 0) {
+		if (errno != ENOSYS)
+			err("pidfd_open: %m");
+		return 0;
+	}
+
+	if (epollin_add(fd_ep, pidfd) < 0) {
+		close(pidfd);
+		return 0;
+	}
+
+	session_set_pidfd(e, pidfd);
+
+	return 0;
+}
 
+static int
+signal_session(struct session *e, int sig)
+{
+	if (e->server_pidfd >= 0) {
+		if (!sys_pidfd_send_signal(e->server_pidfd, sig))
+			return 0;
+		if (errno != ENOSYS) {
+			err("pidfd_send_signal: %m");
+			return -1;
+		}
+	}
+
+	if (kill(e->server_pid, sig) < 0) {
+		err("kill: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The client gets one end of a fresh socket pair, the other end is
+ * handed to the session server. A new session server does that itself
+ * once it is ready, a running one gets its end via the control socket.
+ */
 static int
 start_session(int conn, unsigned num)
 {
+	int rc = -1;
+	int pair[2];
 	uid_t uid;
 	gid_t gid;
-	pid_t server_pid;
-	struct session **a = &pool;
+	struct session *e;
 
 	if (get_peercred(conn, NULL, &uid, &gid) < 0)
 		return -1;
 
-	while (a && *a) {
-		if ((*a)->caller_uid == uid && (*a)->caller_num == num) {
-			send_command_response(conn, CMD_STATUS_DONE, NULL);
-			return 0;
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+		err("socketpair: %m");
+		send_command_response(conn, CMD_STATUS_FAILED, "command failed");
+		return -1;
+	}
+
+	if ((e = session_lookup(uid, num)) != NULL) {
+		if (fds_send(e->server_ctl, &pair[0], 1) < 0) {
+			send_command_response(conn, CMD_STATUS_FAILED, "session server is not available");
+			goto out;
 		}
-		a = &(*a)->next;
+
+		if (!send_command_response(conn, CMD_STATUS_DONE, NULL))
+			fds_send(conn, &pair[1], 1);
+
+		rc = 0;
+		goto out;
 	}
 
 	info("start session for %d:%u user", uid, num);
 
-	if ((server_pid = fork_server(conn, uid, gid, num)) < 0)
-		return -1;
+	rc = spawn_session(conn, pair, uid, gid, num);
+out:
+	close(pair[0]);
+	close(pair[1]);
 
-	*a = calloc(1L, sizeof(struct session));
+	return rc;
+}
 
-	(*a)->caller_uid = uid;
-	(*a)->caller_gid = gid;
-	(*a)->caller_num = num;
-	(*a)->server_pid = server_pid;
+static int
+is_prefork_session(uid_t uid, unsigned num)
+{
+	size_t i;
+
+	for (i = 0; i < server_prefork_size; i++) {
+		if (server_prefork[i].uid == uid && num < server_prefork[i].count)
+			return 1;
+	}
 
 	return 0;
 }
 
+static void
+start_prefork_sessions(void)
+{
+	size_t i;
+
+	for (i = 0; i < server_prefork_size; i++) {
+		struct passwd *pw;
+		unsigned num;
+
+		if (!(pw = getpwnam(server_prefork[i].user))) {
+			err("prefork: %s: user lookup failure", server_prefork[i].user);
+			continue;
+		}
+
+		server_prefork[i].uid = pw->pw_uid;
+
+		for (num = 0; num < server_prefork[i].count; num++) {
+			if (session_lookup(pw->pw_uid, num))
+				continue;
+
+			info("prefork session for %d:%u user", pw->pw_uid, num);
+
+			spawn_session(-1, NULL, pw->pw_uid, pw->pw_gid, num);
+		}
+	}
+}
+
 static int
 close_session(int conn, unsigned num)
 {
 	uid_t uid;
 	gid_t gid;
-	struct session *e = pool;
+	struct session *e;
 
 	if (get_peercred(conn, NULL, &uid, &gid) < 0)
 		return -1;
 
-	while (e) {
-		if (e->caller_uid == uid && e->caller_num == num) {
-			info("close session for %d:%u user by request", uid, num);
-			if (kill(e->server_pid, SIGTERM) < 0) {
-				err("kill: %m");
-				return -1;
-			}
-			break;
-		}
-		e = e->next;
+	if ((e = session_lookup(uid, num)) != NULL) {
+		info("close session for %d:%u user by request", uid, num);
+		if (signal_session(e, SIGTERM) < 0)
+			return -1;
 	}
 
 	return 0;
 }
 
+/*
+ * Requests on the master socket are read incrementally: every accepted
+ * connection is non-blocking and registered in the epoll set, so a slow
+ * client delays nobody but itself.
+ */
+#define REQUEST_TIMEOUT 3
+
+struct request {
+	int fd;
+	time_t deadline;
+	size_t len;
+	struct cmd hdr;
+	unsigned num;
+};
+
+static struct request **requests;
+static size_t requests_size;
+static size_t nrequests;
+
 static int
-process_request(int conn)
+add_request(int conn)
 {
-	int rc;
-	struct cmd hdr = {};
-	unsigned num = 0;
+	struct request *r;
 
-	if (xrecvmsg(conn, &hdr, sizeof(hdr)) < 0)
-		return -1;
+	if ((size_t) conn >= requests_size) {
+		size_t i, size = (size_t) conn + 1;
 
-	if (hdr.datalen != sizeof(num)) {
-		err("bad command");
-		send_command_response(conn, CMD_STATUS_FAILED, "bad command");
-		return -1;
+		if (size < requests_size * 2)
+			size = requests_size * 2;
+
+		requests = xrealloc(requests, size, sizeof(*requests));
+
+		for (i = requests_size; i < size; i++)
+			requests[i] = NULL;
+
+		requests_size = size;
 	}
 
-	if (xrecvmsg(conn, &num, sizeof(num)) < 0)
+	if (epollin_add(fd_ep, conn) < 0)
 		return -1;
 
-	switch (hdr.type) {
+	r = xcalloc(1UL, sizeof(*r));
+	r->fd = conn;
+	r->deadline = monotonic_time() + REQUEST_TIMEOUT;
+
+	requests[conn] = r;
+	nrequests++;
+
+	return 0;
+}
+
+static struct request *
+get_request(int fd)
+{
+	if (fd < 0 || (size_t) fd >= requests_size)
+		return NULL;
+	return requests[fd];
+}
+
+static void
+del_request(struct request *r)
+{
+	requests[r->fd] = NULL;
+	nrequests--;
+
+	epollin_remove(fd_ep, r->fd);
+	free(r);
+}
+
+static void
+expire_requests(int force)
+{
+	size_t i;
+	time_t now = monotonic_time();
+
+	for (i = 0; nrequests && i < requests_size; i++) {
+		struct request *r = requests[i];
+
+		if (!r || (!force && r->deadline > now))
+			continue;
+
+		if (!force)
+			err("request timed out");
+
+		del_request(r);
+	}
+}
+
+/*
+ * Read as much of the request as is available.
+ * Return 1 when the request is complete, 0 when more data is expected
+ * and -1 if the connection should be dropped.
+ */
+static int
+read_request(struct request *r)
+{
+	while (1) {
+		char *buf;
+		size_t want;
+		ssize_t n;
+
+		if (r->len < sizeof(r->hdr)) {
+			buf  = (char *) &r->hdr + r->len;
+			want = sizeof(r->hdr) - r->len;
+		} else {
+			if (r->hdr.datalen != sizeof(r->num)) {
+				err("bad command");
+				send_command_response(r->fd, CMD_STATUS_FAILED, "bad command");
+				return -1;
+			}
+
+			if (r->len == sizeof(r->hdr) + sizeof(r->num))
+				return 1;
+
+			buf  = (char *) &r->num + (r->len - sizeof(r->hdr));
+			want = sizeof(r->hdr) + sizeof(r->num) - r->len;
+		}
+
+		n = TEMP_FAILURE_RETRY(recv(r->fd, buf, want, MSG_DONTWAIT));
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			err("recv: %m");
+			return -1;
+		}
+
+		if (n == 0) {
+			err("recv: unexpected EOF");
+			return -1;
+		}
+
+		r->len += (size_t) n;
+	}
+}
+
+static int
+process_request(struct request *r)
+{
+	int rc;
+	int conn = r->fd;
+	unsigned num = r->num;
+
+	switch (r->hdr.type) {
 		case CMD_OPEN_SESSION:
 			rc = start_session(conn, num);
 			break;
@@ -137,38 +379,125 @@ process_request(int conn)
 }
 
 static void
-finish_sessions(int sig)
+accept_requests(int fd_conn)
 {
-	struct session *e = pool;
+	int conn;
 
-	while (e) {
-		if (kill(e->server_pid, sig) < 0)
-			err("kill: %m");
-		e = e->next;
+	while ((conn = accept4(fd_conn, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (add_request(conn) < 0)
+			close(conn);
 	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		err("accept4: %m");
+}
+
+static void
+handle_request(struct request *r)
+{
+	int rc;
+
+	if ((rc = read_request(r)) == 0)
+		return;
+
+	if (rc > 0)
+		process_request(r);
+
+	del_request(r);
+}
+
+static void
+kill_session(struct session *e, void *data)
+{
+	signal_session(e, *(int *) data);
+}
+
+static void
+finish_sessions(int sig)
+{
+	session_foreach(kill_session, &sig);
 }
 
 static void
 clean_session(pid_t pid)
 {
-	struct session *x, **a = &pool;
+	struct session *e;
+	uid_t uid;
+	gid_t gid;
+	unsigned num;
+	time_t lifetime;
 
-	while (a && *a) {
-		if ((*a)->server_pid == pid) {
-			x = *a;
-			*a = (*a)->next;
-			free(x);
-		}
-		a = &(*a)->next;
+	if ((e = session_lookup_pid(pid)) == NULL)
+		return;
+
+	uid = e->caller_uid;
+	gid = e->caller_gid;
+	num = e->caller_num;
+	lifetime = monotonic_time() - e->start_time;
+
+	if (e->server_pidfd >= 0)
+		epollin_remove(fd_ep, e->server_pidfd);
+
+	if (e->server_ctl >= 0)
+		close(e->server_ctl);
+
+	session_remove(e);
+
+	cgroup_session_remove(uid, num);
+
+	if (finish_server || !is_prefork_session(uid, num))
+		return;
+
+	if (lifetime < PREFORK_MIN_LIFETIME) {
+		err("prefork: session server for %d:%u user exited too early, not respawning", uid, num);
+		return;
 	}
+
+	info("respawn session for %d:%u user", uid, num);
+
+	spawn_session(-1, NULL, uid, gid, num);
 }
 
-static int
-handle_signal(uint32_t signo)
+/*
+ * SIGCHLD is coalesced by signalfd, so reap all exited children
+ * at once. Session servers tracked by pidfd are normally reaped
+ * earlier by reap_session().
+ */
+static void
+reap_children(void)
 {
 	pid_t pid;
 	int status;
 
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		clean_session(pid);
+
+	if (pid < 0 && errno != ECHILD)
+		err("waitpid: %m");
+}
+
+static void
+reap_session(struct session *e)
+{
+	siginfo_t info = {};
+
+	if (pidfd_waitid(e->server_pidfd, &info, WEXITED | WNOHANG) < 0) {
+		if (errno != ECHILD) {
+			err("waitid: %m");
+			return;
+		}
+
+		/* Already reaped by somebody else. */
+		info.si_pid = e->server_pid;
+	}
+
+	if (info.si_pid)
+		clean_session(info.si_pid);
+}
+
+static int
+handle_signal(uint32_t signo)
+{
 	switch (signo) {
 		case SIGINT:
 		case SIGTERM:
@@ -176,12 +505,7 @@ handle_signal(uint32_t signo)
 			break;
 
 		case SIGCHLD:
-			if ((pid = waitpid(-1, &status, 0)) < 0) {
-				err("waitpid: %m");
-				return -1;
-			}
-
-			clean_session(pid);
+			reap_children();
 			break;
 
 		case SIGHUP:
@@ -199,7 +523,6 @@ int main(int argc, char **argv)
 	int sig = SIGTERM;
 	int ep_timeout = -1;
 
-	int fd_ep     = -1;
 	int fd_signal = -1;
 	int fd_conn   = -1;
 
@@ -285,9 +608,12 @@ int main(int argc, char **argv)
 
 	m = umask(017);
 
-	if ((fd_conn = unix_listen(SOCKETDIR, PROJECT)) < 0)
+	if ((fd_conn = unix_listen_backlog(SOCKETDIR, PROJECT, (int) server_listen_backlog)) < 0)
 		return EXIT_FAILURE;
 
+	if (fcntl(fd_conn, F_SETFL, O_NONBLOCK) < 0)
+		fatal("fcntl: %m");
+
 	umask(m);
 
 	snprintf(socketpath, sizeof(socketpath), "%s/%s", SOCKETDIR, PROJECT);
@@ -298,13 +624,18 @@ int main(int argc, char **argv)
 	if (epollin_add(fd_ep, fd_signal) < 0 || epollin_add(fd_ep, fd_conn) < 0)
 		return EXIT_FAILURE;
 
+	(void) cgroup_init();
+
+	start_prefork_sessions();
+
 	while (1) {
 		struct epoll_event ev[42];
 		int fdcount;
 		ssize_t size;
 
 		errno = 0;
-		if ((fdcount = epoll_wait(fd_ep, ev, ARRAY_SIZE(ev), ep_timeout)) < 0) {
+		if ((fdcount = epoll_wait(fd_ep, ev, ARRAY_SIZE(ev),
+					  (nrequests && ep_timeout < 0) ? 1000 : ep_timeout)) < 0) {
 			if (errno == EINTR)
 				continue;
 			err("epoll_wait: %m");
@@ -312,7 +643,16 @@ int main(int argc, char **argv)
 		}
 
 		for (i = 0; i < fdcount; i++) {
-			if (!(ev[i].events & EPOLLIN)) {
+			struct request *r;
+			struct session *e;
+
+			if ((r = get_request(ev[i].data.fd)) != NULL) {
+				handle_request(r);
+
+			} else if ((e = session_lookup_pidfd(ev[i].data.fd)) != NULL) {
+				reap_session(e);
+
+			} else if (!(ev[i].events & EPOLLIN)) {
 				continue;
 
 			} else if (ev[i].data.fd == fd_signal) {
@@ -327,32 +667,22 @@ int main(int argc, char **argv)
 				handle_signal(fdsi.ssi_signo);
 
 			} else if (ev[i].data.fd == fd_conn) {
-				int conn;
-
-				if ((conn = accept4(fd_conn, NULL, 0, SOCK_CLOEXEC)) < 0) {
-					err("accept4: %m");
-					continue;
-				}
-
-				if (set_recv_timeout(conn, 3) < 0) {
-					close(conn);
-					continue;
-				}
-
-				process_request(conn);
-
-				close(conn);
+				accept_requests(fd_conn);
 			}
 		}
 
+		if (nrequests)
+			expire_requests(0);
+
 		if (finish_server) {
-			if (!pool)
+			if (!session_count())
 				break;
 
 			if (fd_conn >= 0) {
 				epollin_remove(fd_ep, fd_conn);
 				fd_conn = -1;
 				ep_timeout = 3000;
+				expire_requests(1);
 			}
 
 			finish_sessions(sig);
@@ -28,71 +28,35 @@
 #include <unistd.h>
 
 #include "priv.h"
-#include "xmalloc.h"
-
-static int *fd_list;
-static size_t fd_count;
-
-static void
-fd_new(int fd)
-{
-	if (fd < 0)
-		return;
-
-	size_t  i;
-
-	for (i = 0; i < fd_count; ++i)
-		if (fd_list[i] < 0)
-			break;
-
-	if (i == fd_count)
-		fd_list = xrealloc(fd_list, ++fd_count, sizeof(*fd_list));
-
-	fd_list[i] = fd;
-	unblock_fd(fd);
-}
+#include "io_loop.h"
 
 static void
 fd_free(const int fd)
 {
-	size_t  i;
-
-	for (i = 0; i < fd_count; ++i)
-		if (fd == fd_list[i])
-			break;
-
-	if (i == fd_count)
-		error(EXIT_FAILURE, 0,
-		      "fd_free: descriptor %d not found, count=%lu\n",
-		      fd, (unsigned long) fd_count);
-
-	fd_list[i] = -1;
+	io_watch_del(fd);
 	(void) close(fd);
 }
 
-void
-log_handle_new(const int fd, fd_set *fds)
-{
-	if (fds_isset(fds, fd))
-		fd_new(unix_accept(fd));
-}
-
-void
-fds_add_log(fd_set *fds, int *max_fd)
-{
-	size_t  i;
-
-	for (i = 0; i < fd_count; ++i)
-		fds_add_fd(fds, max_fd, fd_list[i]);
-}
-
 static void
-copy_log(const int fd)
+copy_log(const int fd, void __attribute__ ((unused)) *data)
 {
 	ssize_t i;
 	char    buf[BUFSIZ];
 
+	if (!(io_ready(fd) & EPOLLIN))
+		return;
+
+	/* Stop reading until there is room in the stderr queue. */
+	if (!output_wait(STDERR_FILENO, sizeof(buf), fd))
+		return;
+
 	i = read_retry(fd, buf, sizeof(buf) - 2);
+	if (i < 0 && errno == EAGAIN)
+	{
+		io_ready_clear(fd, EPOLLIN);
+		return;
+	}
+
 	if (i <= 0)
 	{
 		fd_free(fd);
@@ -109,16 +73,31 @@ copy_log(const int fd)
 		buf[n++] = '\n';
 	}
 
-	xwrite_all(STDERR_FILENO, buf, n);
+	output_queue(STDERR_FILENO, buf, n);
+	io_watch_wake(fd);
 }
 
+static void
+log_handle_new(const int log_fd, void __attribute__ ((unused)) *data)
+{
+	int     fd;
+
+	if (!(io_ready(log_fd) & EPOLLIN))
+		return;
+
+	while ((fd = unix_accept(log_fd)) >= 0)
+	{
+		unblock_fd(fd);
+		io_watch_add(fd, EPOLLIN, copy_log, NULL);
+	}
+
+	if (errno == EAGAIN)
+		io_ready_clear(log_fd, EPOLLIN);
+}
 
 void
-log_handle_select(fd_set *fds)
+log_watch_listen(const int log_fd)
 {
-	size_t  i;
-
-	for (i = 0; i < fd_count; ++i)
-		if (fds_isset(fds, fd_list[i]))
-			copy_log(fd_list[i]);
+	unblock_fd(log_fd);
+	io_watch_add(log_fd, EPOLLIN, log_handle_new, NULL);
 }
@@ -0,0 +1,333 @@
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_loop.h"
+#include "xmalloc.h"
+
+/*
+ * Event loop of the chrootuid relay.
+ *
+ * Descriptors are registered once and stay in the epoll set until
+ * they are removed. Registrations are edge-triggered: readiness
+ * reported by the kernel is remembered until the handler clears it
+ * after getting EAGAIN; EPOLLHUP stays set once seen. A handler which
+ * stops early (its buffer is full or it yields to other channels) is
+ * called again only after io_watch_wake(), so every wakeup costs O(1)
+ * regardless of the number of registered descriptors.
+ *
+ * Descriptors which are not in non-blocking mode (caller's stdin)
+ * cannot be drained until EAGAIN, their readiness is checked with
+ * poll() instead. Descriptors not supported by epoll (regular files)
+ * are always ready.
+ *
+ * The time of the last event is kept for idle time accounting; events
+ * of quiet descriptors (timers) are not counted.
+ */
+
+enum {
+	IO_EDGE = 0,
+	IO_LEVEL,
+	IO_ALWAYS,
+};
+
+struct io_watch {
+	io_handler_t fn;
+	void *data;
+	uint32_t events;
+	uint32_t ready;
+	int mode;
+	int queued;
+	int quiet;
+};
+
+static int fd_ep = -1;
+static struct timespec last_event;
+
+static struct io_watch **watches;
+static size_t watches_size;
+static size_t nwatches;
+
+/* descriptors to dispatch on the next round */
+static int *wake_list, *run_list;
+static size_t wake_count, wake_size, run_size;
+
+void
+io_loop_init(void)
+{
+	if ((fd_ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		error(EXIT_FAILURE, errno, "epoll_create1");
+
+	clock_gettime(CLOCK_MONOTONIC, &last_event);
+}
+
+static struct io_watch *
+get_watch(int fd)
+{
+	if (fd < 0 || (size_t) fd >= watches_size)
+		return NULL;
+	return watches[fd];
+}
+
+void
+io_watch_wake(int fd)
+{
+	struct io_watch *w = get_watch(fd);
+
+	if (!w || w->queued)
+		return;
+
+	if (wake_count == wake_size) {
+		wake_size = wake_size ? wake_size * 2 : 16;
+		wake_list = xrealloc(wake_list, wake_size, sizeof(*wake_list));
+	}
+
+	wake_list[wake_count++] = fd;
+	w->queued = 1;
+}
+
+void
+io_watch_add(int fd, uint32_t events, io_handler_t fn, void *data)
+{
+	struct epoll_event ev = {};
+	struct io_watch *w;
+	int flags;
+
+	if ((size_t) fd >= watches_size) {
+		size_t i, size = (size_t) fd + 1;
+
+		if (size < watches_size * 2)
+			size = watches_size * 2;
+
+		watches = xrealloc(watches, size, sizeof(*watches));
+
+		for (i = watches_size; i < size; i++)
+			watches[i] = NULL;
+
+		watches_size = size;
+	}
+
+	w = xcalloc(1UL, sizeof(*w));
+	w->fn = fn;
+	w->data = data;
+	w->events = events;
+
+	if ((flags = fcntl(fd, F_GETFL)) < 0)
+		error(EXIT_FAILURE, errno, "fcntl F_GETFL");
+
+	w->mode = (flags & O_NONBLOCK) ? IO_EDGE : IO_LEVEL;
+
+	ev.events = events | EPOLLET;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(fd_ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno != EPERM)
+			error(EXIT_FAILURE, errno, "epoll_ctl");
+		w->mode = IO_ALWAYS;
+	}
+
+	watches[fd] = w;
+	nwatches++;
+
+	/* Let the handler look at the initial state. */
+	io_watch_wake(fd);
+}
+
+void
+io_watch_del(int fd)
+{
+	struct io_watch *w = get_watch(fd);
+
+	if (!w)
+		return;
+
+	if (w->mode != IO_ALWAYS)
+		(void) epoll_ctl(fd_ep, EPOLL_CTL_DEL, fd, NULL);
+
+	watches[fd] = NULL;
+	nwatches--;
+	free(w);
+}
+
+void
+io_watch_quiet(int fd)
+{
+	struct io_watch *w = get_watch(fd);
+
+	if (w)
+		w->quiet = 1;
+}
+
+/*
+ * Select events reported by the kernel for FD, e.g. to stop wakeups
+ * about a writable descriptor which has nothing to write. Readiness
+ * returned by io_ready() is not affected.
+ */
+void
+io_watch_arm(int fd, uint32_t events)
+{
+	struct io_watch *w = get_watch(fd);
+	struct epoll_event ev = {};
+
+	if (!w || w->mode == IO_ALWAYS)
+		return;
+
+	ev.events = events | EPOLLET;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(fd_ep, EPOLL_CTL_MOD, fd, &ev) < 0)
+		error(EXIT_FAILURE, errno, "epoll_ctl");
+}
+
+uint32_t
+io_ready(int fd)
+{
+	struct io_watch *w = get_watch(fd);
+	struct pollfd pfd;
+
+	if (!w)
+		return 0;
+
+	switch (w->mode) {
+		case IO_ALWAYS:
+			return w->events;
+
+		case IO_LEVEL:
+			pfd.fd = fd;
+			pfd.events = (short) (((w->events & EPOLLIN) ? POLLIN : 0) |
+					      ((w->events & EPOLLOUT) ? POLLOUT : 0));
+			pfd.revents = 0;
+
+			if (poll(&pfd, 1, 0) <= 0)
+				return 0;
+
+			if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+				return w->events | EPOLLHUP;
+
+			return ((pfd.revents & POLLIN) ? EPOLLIN : 0) |
+			       ((pfd.revents & POLLOUT) ? EPOLLOUT : 0);
+	}
+
+	return w->ready;
+}
+
+void
+io_ready_clear(int fd, uint32_t events)
+{
+	struct io_watch *w = get_watch(fd);
+
+	if (w)
+		w->ready &= ~events;
+}
+
+size_t
+io_watch_count(void)
+{
+	return nwatches;
+}
+
+void
+io_loop_last_event(struct timespec *ts)
+{
+	*ts = last_event;
+}
+
+/*
+ * epoll_pwait() delivers signals only when it fails with EINTR, which
+ * never happens with zero timeout or while some descriptor keeps
+ * reporting events (e.g. a hung up pty). Let pending signals in
+ * explicitly.
+ */
+static int
+signal_pending(const sigset_t *sigmask)
+{
+	sigset_t pending, mask;
+	int i;
+
+	if (!sigmask || sigpending(&pending) < 0)
+		return 0;
+
+	for (i = 1; i < NSIG; i++) {
+		if (!sigismember(&pending, i) || sigismember(sigmask, i))
+			continue;
+
+		if (sigprocmask(SIG_SETMASK, sigmask, &mask) < 0)
+			error(EXIT_FAILURE, errno, "sigprocmask");
+		if (sigprocmask(SIG_SETMASK, &mask, NULL) < 0)
+			error(EXIT_FAILURE, errno, "sigprocmask");
+
+		errno = EINTR;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait for events and call handlers of ready and woken descriptors.
+ * Return the number of events and wakeups processed, 0 on timeout
+ * or -1 on error.
+ */
+int
+io_loop_wait(int timeout, const sigset_t *sigmask)
+{
+	struct epoll_event ev[64];
+	int i, n, active = 0;
+	size_t count, size;
+	int *list;
+
+	if (signal_pending(sigmask))
+		return -1;
+
+	if ((n = epoll_pwait(fd_ep, ev, (int) (sizeof(ev) / sizeof(ev[0])),
+			     wake_count ? 0 : timeout, sigmask)) < 0)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		struct io_watch *w = get_watch(ev[i].data.fd);
+
+		if (!w)
+			continue;
+
+		if (ev[i].events & (EPOLLHUP | EPOLLERR))
+			w->ready |= w->events | EPOLLHUP;
+
+		w->ready |= ev[i].events & (EPOLLIN | EPOLLOUT);
+
+		if (!w->quiet)
+			active = 1;
+
+		io_watch_wake(ev[i].data.fd);
+	}
+
+	if (active)
+		clock_gettime(CLOCK_MONOTONIC, &last_event);
+
+	/* Handlers woken from now on are called on the next round. */
+	list = wake_list;
+	count = wake_count;
+	size = wake_size;
+
+	wake_list = run_list;
+	wake_size = run_size;
+	wake_count = 0;
+
+	run_list = list;
+	run_size = size;
+
+	for (i = 0; (size_t) i < count; i++) {
+		struct io_watch *w = get_watch(list[i]);
+
+		if (!w)
+			continue;
+
+		w->queued = 0;
+		w->fn(list[i], w->data);
+	}
+
+	return n + (int) count;
+}
@@ -0,0 +1,24 @@
+#ifndef _IO_LOOP_H_
+#define _IO_LOOP_H_
+
+#include <sys/epoll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef void (*io_handler_t)(int fd, void *data);
+
+void io_loop_init(void);
+void io_watch_add(int fd, uint32_t events, io_handler_t fn, void *data);
+void io_watch_del(int fd);
+void io_watch_arm(int fd, uint32_t events);
+void io_watch_quiet(int fd);
+void io_watch_wake(int fd);
+uint32_t io_ready(int fd);
+void io_ready_clear(int fd, uint32_t events);
+size_t io_watch_count(void);
+void io_loop_last_event(struct timespec *ts);
+int io_loop_wait(int timeout, const sigset_t *sigmask);
+
+#endif /* _IO_LOOP_H_ */
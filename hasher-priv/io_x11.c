@@ -29,6 +29,7 @@
 
 #include "priv.h"
 #include "xmalloc.h"
+#include "io_loop.h"
 
 struct io_x11
 {
@@ -40,46 +41,31 @@ struct io_x11
 
 typedef struct io_x11 *io_x11_t;
 
-static io_x11_t *io_x11_list;
-static size_t io_x11_count;
+static const char *auth_saved_data, *auth_fake_data;
+
+static void io_x11_handle(int fd, void *data);
 
 static  io_x11_t
 io_x11_new(int master_fd, int slave_fd)
 {
-	size_t i;
-
-	for (i = 0; i < io_x11_count; ++i)
-		if (!io_x11_list[i])
-			break;
-
-	if (i == io_x11_count)
-		io_x11_list =
-			xrealloc(io_x11_list,
-				 ++io_x11_count, sizeof(*io_x11_list));
-
-	io_x11_t io = io_x11_list[i] = xcalloc(1UL, sizeof(*io_x11_list[i]));
+	io_x11_t io = xcalloc(1UL, sizeof(*io));
 
 	io->master_fd = master_fd;
 	io->slave_fd = slave_fd;
 	unblock_fd(master_fd);
 	unblock_fd(slave_fd);
 
+	io_watch_add(master_fd, EPOLLIN | EPOLLOUT, io_x11_handle, io);
+	io_watch_add(slave_fd, EPOLLIN | EPOLLOUT, io_x11_handle, io);
+
 	return io;
 }
 
 static void
 io_x11_free(io_x11_t io)
 {
-	size_t i;
-
-	for (i = 0; i < io_x11_count; ++i)
-		if (io_x11_list[i] == io)
-			break;
-	if (i == io_x11_count)
-		error(EXIT_FAILURE, 0,
-		      "io_x11_free: entry %p not found, count=%lu\n", io,
-		      (unsigned long) io_x11_count);
-	io_x11_list[i] = 0;
+	io_watch_del(io->master_fd);
+	io_watch_del(io->slave_fd);
 
 	(void) close(io->master_fd);
 	(void) close(io->slave_fd);
@@ -87,47 +73,37 @@ io_x11_free(io_x11_t io)
 	free(io);
 }
 
-void
-x11_handle_new(const int x11_fd, fd_set *read_fds)
+static void
+x11_handle_new(const int x11_fd, void __attribute__ ((unused)) *data)
 {
-	if (!fds_isset(read_fds, x11_fd))
-		return;
+	int     accept_fd;
 
-	int     accept_fd = unix_accept(x11_fd);
-
-	if (accept_fd < 0)
+	if (!(io_ready(x11_fd) & EPOLLIN))
 		return;
 
-	int     connect_fd = x11_connect();
+	while ((accept_fd = unix_accept(x11_fd)) >= 0)
+	{
+		int     connect_fd = x11_connect();
+
+		if (connect_fd >= 0)
+			io_x11_new(connect_fd, accept_fd);
+		else
+			(void) close(accept_fd);
+	}
 
-	if (connect_fd >= 0)
-		io_x11_new(connect_fd, accept_fd);
-	else
-		(void) close(accept_fd);
+	if (errno == EAGAIN)
+		io_ready_clear(x11_fd, EPOLLIN);
 }
 
 void
-fds_add_x11(fd_set *read_fds, fd_set *write_fds, int *max_fd)
+x11_watch_listen(const int x11_fd, const char *saved_data,
+		 const char *fake_data)
 {
-	size_t i;
+	auth_saved_data = saved_data;
+	auth_fake_data = fake_data;
 
-	for (i = 0; i < io_x11_count; ++i)
-	{
-		io_x11_t io;
-
-		if (!(io = io_x11_list[i]))
-			continue;
-
-		if (io->slave_avail)
-			fds_add_fd(write_fds, max_fd, io->master_fd);
-		else
-			fds_add_fd(read_fds, max_fd, io->slave_fd);
-
-		if (io->master_avail)
-			fds_add_fd(write_fds, max_fd, io->slave_fd);
-		else
-			fds_add_fd(read_fds, max_fd, io->master_fd);
-	}
+	unblock_fd(x11_fd);
+	io_watch_add(x11_fd, EPOLLIN, x11_handle_new, NULL);
 }
 
 static void
@@ -193,83 +169,72 @@ io_check_auth_data(io_x11_t io, const char *x11_saved_data,
 	       x11_saved_data, x11_data_len);
 }
 
-void
-x11_handle_select(fd_set *read_fds, fd_set *write_fds,
-		  const char *x11_saved_data, const char *x11_fake_data)
+/*
+ * Move data from SRC_FD to DST_FD through BUF.
+ * Return 1 if some data was moved, 0 if none, -1 if the channel is closed.
+ */
+static int
+io_x11_copy(io_x11_t io, int src_fd, int dst_fd, char *buf, size_t *avail)
 {
-	size_t i;
+	int     moved = 0;
 	ssize_t n;
 
-	for (i = 0; i < io_x11_count; ++i)
+	if (*avail && (io_ready(dst_fd) & EPOLLOUT))
 	{
-		io_x11_t io;
-
-		if (!(io = io_x11_list[i]))
-			continue;
-
-		if (io->master_avail && fds_isset(write_fds, io->slave_fd))
+		n = write_loop(dst_fd, buf, *avail);
+		if (n < 0 && errno == EAGAIN)
+			io_ready_clear(dst_fd, EPOLLOUT);
+		else if (n <= 0)
+			return -1;
+		else
 		{
-			n = write_loop(io->slave_fd,
-				       io->master_buf, io->master_avail);
-			if (n <= 0)
+			if ((size_t) n < *avail)
 			{
-				io_x11_free(io);
-				continue;
+				memmove(buf, buf + (size_t) n,
+					*avail - (size_t) n);
+				io_ready_clear(dst_fd, EPOLLOUT);
 			}
-
-			if ((size_t) n < io->master_avail)
-			{
-				memmove(io->master_buf,
-					io->master_buf + (size_t) n,
-					io->master_avail - (size_t) n);
-			}
-			io->master_avail -= (size_t) n;
+			*avail -= (size_t) n;
+			moved = 1;
 		}
+	}
 
-		if (!io->master_avail && fds_isset(read_fds, io->master_fd))
+	if (!*avail && (io_ready(src_fd) & EPOLLIN))
+	{
+		n = read_retry(src_fd, buf, BUFSIZ);
+		if (n < 0 && errno == EAGAIN)
+			io_ready_clear(src_fd, EPOLLIN);
+		else if (n <= 0)
+			return -1;
+		else
 		{
-			n = read_retry(io->master_fd,
-				       io->master_buf, sizeof io->master_buf);
-			if (n <= 0)
-			{
-				io_x11_free(io);
-				continue;
-			}
-
-			io->master_avail = (size_t) n;
+			*avail = (size_t) n;
+			if (src_fd == io->slave_fd)
+				io_check_auth_data(io, auth_saved_data,
+						   auth_fake_data);
+			moved = 1;
 		}
+	}
 
-		if (io->slave_avail && fds_isset(write_fds, io->master_fd))
-		{
-			n = write_loop(io->master_fd,
-				       io->slave_buf, io->slave_avail);
-			if (n <= 0)
-			{
-				io_x11_free(io);
-				continue;
-			}
-
-			if ((size_t) n < io->slave_avail)
-			{
-				memmove(io->slave_buf,
-					io->slave_buf + (size_t) n,
-					io->slave_avail - (size_t) n);
-			}
-			io->slave_avail -= (size_t) n;
-		}
+	return moved;
+}
 
-		if (!io->slave_avail && fds_isset(read_fds, io->slave_fd))
-		{
-			n = read_retry(io->slave_fd,
-				       io->slave_buf, sizeof io->slave_buf);
-			if (n <= 0)
-			{
-				io_x11_free(io);
-				continue;
-			}
+static void
+io_x11_handle(int __attribute__ ((unused)) fd, void *data)
+{
+	io_x11_t io = data;
+	int     in, out;
 
-			io->slave_avail = (size_t) n;
-			io_check_auth_data(io, x11_saved_data, x11_fake_data);
-		}
+	if ((in = io_x11_copy(io, io->master_fd, io->slave_fd,
+			      io->master_buf, &io->master_avail)) < 0 ||
+	    (out = io_x11_copy(io, io->slave_fd, io->master_fd,
+			       io->slave_buf, &io->slave_avail)) < 0)
+	{
+		io_x11_free(io);
+		return;
 	}
+
+	/* Let other channels run before moving more data. */
+	if (in || out)
+		io_watch_wake(io->master_fd);
 }
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <sys/prctl.h>
 
+#include "cgroup.h"
 #include "priv.h"
 
 #ifndef	PR_SET_DUMPABLE
@@ -40,6 +41,7 @@ int
 do_killuid(void)
 {
 	uid_t u = getuid();
+	int killed;
 
 	if (change_uid1 < MIN_CHANGE_UID || change_uid1 == u)
 		error(EXIT_FAILURE, 0, "killuid: invalid uid: %u", change_uid1);
@@ -49,10 +51,17 @@ do_killuid(void)
 	if (prctl(PR_SET_DUMPABLE, 0) && !__libc_enable_secure)
 		error(EXIT_FAILURE, errno, "killuid: prctl PR_SET_DUMPABLE");
 
+	/*
+	 * Processes of both pseudousers live in the task cgroups of the
+	 * session, kill them all at once if possible.
+	 */
+	if ((killed = cgroup_kill_tasks()) < 0)
+		error(EXIT_FAILURE, errno, "killuid: cgroup");
+
 	if (setreuid(change_uid1, change_uid2) < 0)
 		error(EXIT_FAILURE, errno, "killuid: setreuid");
 
-	if (kill(-1, SIGKILL))
+	if (!killed && kill(-1, SIGKILL))
 		error(EXIT_FAILURE, errno, "killuid: kill");
 
 	purge_ipc(change_uid1, change_uid2);
@@ -29,27 +29,24 @@
 #include <fcntl.h>
 #include <time.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 
 #include "priv.h"
 #include "xmalloc.h"
+#include "io_loop.h"
+#include "pidfd.h"
+#include "ringbuf.h"
+#include "usage.h"
 
 static volatile pid_t child_pid;
+static int child_pidfd = -1;
 
 static volatile sig_atomic_t sigwinch_arrived;
 
-static int
-xselect(int nfds, fd_set *read_fds, fd_set *write_fds,
-	const unsigned long int timeout)
-{
-	const struct timespec tmout = {.tv_sec = (time_t) timeout };
-	const sigset_t sigmask = {};
-
-	return pselect(nfds, read_fds, write_fds, NULL,
-		       (timeout ? &tmout : NULL), &sigmask);
-}
-
 static void
 sigwinch_handler(int __attribute__((unused)) signo)
 {
@@ -58,10 +55,30 @@ sigwinch_handler(int __attribute__((unused)) signo)
 
 static int child_rc;
 
+static void
+set_child_rc(const siginfo_t *info)
+{
+	switch (info->si_code)
+	{
+		case CLD_EXITED:
+			if (info->si_status)
+				child_rc = info->si_status;
+			break;
+		case CLD_KILLED:
+		case CLD_DUMPED:
+			child_rc = 128 + info->si_status;
+			break;
+		default:
+			/* quite strange condition */
+			child_rc = 255;
+	}
+}
+
+/* Used only if the child cannot be tracked by pidfd. */
 static void
 sigchld_handler(int __attribute__ ((unused)) signo)
 {
-	int     status;
+	siginfo_t info = {};
 	pid_t   child = child_pid;
 
 	/* handle only one child */
@@ -69,23 +86,37 @@ sigchld_handler(int __attribute__ ((unused)) signo)
 		return;
 	child_pid = 0;
 
-	if (waitpid(child, &status, 0) != child)
-		error(EXIT_FAILURE, errno, "waitpid");
+	if (waitid(P_PID, (id_t) child, &info, WEXITED) < 0)
+		error(EXIT_FAILURE, errno, "waitid");
 
-	if (WIFEXITED(status))
-	{
-		if (WEXITSTATUS(status))
-		{
-			child_rc = WEXITSTATUS(status);
-		}
-	} else if (WIFSIGNALED(status))
-	{
-		child_rc = 128 + WTERMSIG(status);
-	} else
-	{
-		/* quite strange condition */
-		child_rc = 255;
-	}
+	set_child_rc(&info);
+}
+
+/* Reap the child as soon as its pidfd becomes readable. */
+static void
+reap_child(void)
+{
+	siginfo_t info = {};
+
+	if (pidfd_waitid(child_pidfd, &info, WEXITED | WNOHANG) < 0)
+		error(EXIT_FAILURE, errno, "waitid");
+
+	if (!info.si_pid)
+		return;
+
+	child_pid = 0;
+	set_child_rc(&info);
+
+	io_watch_del(child_pidfd);
+	(void) close(child_pidfd);
+	child_pidfd = -1;
+}
+
+static void
+handle_child_exit(int fd, void __attribute__ ((unused)) *data)
+{
+	if (io_ready(fd) & EPOLLIN)
+		reap_child();
 }
 
 static void
@@ -106,17 +137,30 @@ wait_child(void)
 {
 	unsigned i;
 
+	if (child_pidfd >= 0)
+	{
+		struct pollfd pfd = { .fd = child_pidfd, .events = POLLIN };
+
+		/* Give the child a second to exit after the pty hangup. */
+		if (child_pid && poll(&pfd, 1, 1000) > 0)
+			reap_child();
+		return;
+	}
+
 	block_signal_handler(SIGCHLD, SIG_UNBLOCK);
 	for (i = 0; i < 10; ++i)
 		if (child_pid)
 			usleep(100000);
 }
 
+static void restore_output(void);
+
 static void __attribute__ ((noreturn, format(printf, 1, 0)))
 limit_exceeded(const char *fmt, unsigned long limit)
 {
 	forget_child();
 	restore_tty();
+	restore_output();
 	fputc('\n', stderr);
 	error(128 + SIGTERM, 0, fmt, limit);
 	exit(128 + SIGTERM);
@@ -135,39 +179,180 @@ work_limits_ok(unsigned long bytes_read, unsigned long bytes_written)
 		limit_exceeded("bytes written limit (%lu bytes) exceeded",
 			       wlimit.bytes_written);
 
-	if (wlimit.time_elapsed)
-	{
-		static time_t t_start;
+	return 1;
+}
 
-		if (!t_start)
-			time(&t_start);
-		else
-		{
-			time_t  t_now;
+/* How often CPU time and RSS of the child are checked, in milliseconds. */
+#define USAGE_INTERVAL 1000
 
-			time(&t_now);
-			if (t_start + (time_t) wlimit.time_elapsed <= t_now)
-				limit_exceeded
-					("time elapsed limit (%lu seconds) exceeded",
-					 wlimit.time_elapsed);
-		}
+static size_t timer_count;
+
+static int
+timer_create_fd(void)
+{
+	int     fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		error(EXIT_FAILURE, errno, "timerfd_create");
+
+	++timer_count;
+	return fd;
+}
+
+static void
+timer_set(int fd, int flags, const struct timespec *value,
+	  const struct timespec *interval)
+{
+	struct itimerspec its = {};
+
+	its.it_value = *value;
+	if (interval)
+		its.it_interval = *interval;
+
+	if (timerfd_settime(fd, flags, &its, NULL) < 0)
+		error(EXIT_FAILURE, errno, "timerfd_settime");
+}
+
+/* Consume timer expirations, return 0 if there were none. */
+static int
+timer_expired(int fd)
+{
+	uint64_t count;
+
+	if (!(io_ready(fd) & EPOLLIN))
+		return 0;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+	{
+		if (errno != EAGAIN)
+			error(EXIT_FAILURE, errno, "read");
+		io_ready_clear(fd, EPOLLIN);
+		return 0;
 	}
 
 	return 1;
 }
 
+static void
+handle_elapsed_timer(int fd, void __attribute__ ((unused)) *data)
+{
+	if (timer_expired(fd))
+		limit_exceeded("time elapsed limit (%lu seconds) exceeded",
+			       wlimit.time_elapsed);
+}
+
+/* Fire at the last event plus the idle limit, until nothing happens. */
+static void
+handle_idle_timer(int fd, void __attribute__ ((unused)) *data)
+{
+	struct timespec deadline, now;
+
+	if (!timer_expired(fd))
+		return;
+
+	io_loop_last_event(&deadline);
+	deadline.tv_sec += (time_t) wlimit.time_idle;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec > deadline.tv_sec
+	    || (now.tv_sec == deadline.tv_sec
+		&& now.tv_nsec >= deadline.tv_nsec))
+		limit_exceeded("idle time limit (%lu seconds) exceeded",
+			       wlimit.time_idle);
+
+	timer_set(fd, TFD_TIMER_ABSTIME, &deadline, NULL);
+}
+
+static void
+handle_usage_timer(int fd, void __attribute__ ((unused)) *data)
+{
+	struct usage u;
+
+	if (!timer_expired(fd) || !child_pid)
+		return;
+
+	if (usage_get(child_pid, &u) < 0)
+		return;
+
+	if (wlimit.time_cpu
+	    && u.cpu_msec >= (unsigned long long) wlimit.time_cpu * 1000)
+		limit_exceeded("CPU time limit (%lu seconds) exceeded",
+			       wlimit.time_cpu);
+
+	if (wlimit.bytes_rss
+	    && u.rss >= (unsigned long long) wlimit.bytes_rss)
+		limit_exceeded("RSS limit (%lu bytes) exceeded",
+			       wlimit.bytes_rss);
+}
+
+static void
+init_timers(void)
+{
+	struct timespec ts = {};
+	int     fd;
+
+	if (wlimit.time_elapsed)
+	{
+		fd = timer_create_fd();
+		ts.tv_sec = (time_t) wlimit.time_elapsed;
+		timer_set(fd, 0, &ts, NULL);
+		io_watch_add(fd, EPOLLIN, handle_elapsed_timer, NULL);
+		io_watch_quiet(fd);
+	}
+
+	if (wlimit.time_idle)
+	{
+		fd = timer_create_fd();
+		ts.tv_sec = (time_t) wlimit.time_idle;
+		timer_set(fd, 0, &ts, NULL);
+		io_watch_add(fd, EPOLLIN, handle_idle_timer, NULL);
+		io_watch_quiet(fd);
+	}
+
+	if (wlimit.time_cpu || wlimit.bytes_rss)
+	{
+		fd = timer_create_fd();
+		ts.tv_sec = USAGE_INTERVAL / 1000;
+		ts.tv_nsec = (USAGE_INTERVAL % 1000) * 1000000L;
+		timer_set(fd, 0, &ts, &ts);
+		io_watch_add(fd, EPOLLIN, handle_usage_timer, NULL);
+		io_watch_quiet(fd);
+	}
+}
+
 struct io_std
 {
 	int     master_read_fd, master_write_out_fd, master_write_err_fd;
 	int     slave_read_out_fd, slave_read_err_fd, slave_write_fd;
-	size_t  master_avail, slave_avail;
-	char    master_buf[BUFSIZ], slave_buf[BUFSIZ];
+	int     no_splice_out, no_splice_err;
+	struct ringbuf input;
 };
 
 typedef struct io_std *io_std_t;
 
+/* Output queue of caller's stdout or stderr. */
+struct io_out
+{
+	int     fd;
+	int     saved_flags;
+	int     armed;
+	struct ringbuf queue;
+
+	/* descriptors waiting for the queue to drain */
+	int    *waiters;
+	size_t  waiters_count, waiters_size;
+};
+
+typedef struct io_out *io_out_t;
+
+static struct io_out io_out_list[2] = {
+	{.fd = STDOUT_FILENO,.saved_flags = -1 },
+	{.fd = STDERR_FILENO,.saved_flags = -1 }
+};
+
 static int pty_fd = -1, ctl_fd = -1, x11_fd = -1, log_fd = -1;
 static unsigned long total_bytes_read, total_bytes_written;
+static int io_failed, child_detached;
 
 static char *x11_saved_data, *x11_fake_data;
 
@@ -216,148 +401,501 @@ handle_x11_ctl(void)
 	return fd;
 }
 
-static int
-handle_io(io_std_t io)
+static  io_out_t
+output_get(int fd)
 {
-	ssize_t n;
-	int     rc;
-	int     max_fd = 0;
-	fd_set  read_fds, write_fds;
+	return &io_out_list[fd == STDERR_FILENO];
+}
 
-	FD_ZERO(&read_fds);
-	FD_ZERO(&write_fds);
+static void
+output_add_waiter(io_out_t out, int fd)
+{
+	size_t  i;
 
-	if (sigwinch_arrived)
+	for (i = 0; i < out->waiters_count; ++i)
+		if (out->waiters[i] == fd)
+			return;
+
+	if (out->waiters_count == out->waiters_size)
 	{
-		sigwinch_arrived = 0;
-		(void) tty_copy_winsize(STDIN_FILENO, pty_fd);
+		out->waiters_size = out->waiters_size ? out->waiters_size * 2 : 8;
+		out->waiters = xrealloc(out->waiters, out->waiters_size,
+					sizeof(*out->waiters));
 	}
 
-	/* Select child output, error, log and x11 descriptors
-	   even after child process completion. */
-	fds_add_fd(&read_fds, &max_fd, io->slave_read_out_fd);
-	fds_add_fd(&read_fds, &max_fd, io->slave_read_err_fd);
-	fds_add_log(&read_fds, &max_fd);
-	fds_add_x11(&read_fds, &write_fds, &max_fd);
+	out->waiters[out->waiters_count++] = fd;
+}
 
-	if (child_pid)
+/*
+ * Caller's descriptors are watched for EPOLLOUT only while they are
+ * full, otherwise every read by the caller would wake the relay up.
+ */
+static void
+output_arm(io_out_t out, int on)
+{
+	if (out->armed == on)
+		return;
+
+	io_watch_arm(out->fd, on ? EPOLLOUT : 0U);
+	out->armed = on;
+}
+
+/*
+ * Return 1 if COUNT bytes can be queued for OUT_FD.  Otherwise the
+ * handler of FD is woken up when the queue drains.
+ */
+int
+output_wait(int out_fd, size_t count, int fd)
+{
+	io_out_t out = output_get(out_fd);
+
+	if (ringbuf_space(&out->queue) >= count)
+		return 1;
+
+	output_add_waiter(out, fd);
+	return 0;
+}
+
+void
+output_queue(int out_fd, const char *buffer, size_t count)
+{
+	io_out_t out = output_get(out_fd);
+
+	ringbuf_put(&out->queue, buffer, count);
+	total_bytes_written += count;
+
+	io_watch_wake(out_fd);
+}
+
+static void
+handle_output(int fd, void *data)
+{
+	io_out_t out = data;
+	size_t  i;
+
+	if (!(io_ready(fd) & EPOLLOUT))
+		return;
+
+	output_arm(out, 0);
+
+	if (out->queue.len)
 	{
-		/* Select child input, tty input and listeners
-		   only if child process is alive. */
-		if (io->master_avail)
-			fds_add_fd(&write_fds, &max_fd, io->slave_write_fd);
-		else
-			fds_add_fd(&read_fds, &max_fd, io->master_read_fd);
+		ssize_t n = ringbuf_writev(&out->queue, fd);
 
-		fds_add_fd(&read_fds, &max_fd, log_fd);
-		fds_add_fd(&read_fds, &max_fd, ctl_fd);
-		fds_add_fd(&read_fds, &max_fd, x11_fd);
-	} else
+		if (n < 0 && errno == EAGAIN)
+		{
+			io_ready_clear(fd, EPOLLOUT);
+			output_arm(out, 1);
+			return;
+		}
+
+		if (n < 0)
+			error(EXIT_FAILURE, errno, "write");
+
+		/* Retry until EAGAIN. */
+		if (out->queue.len)
+			io_watch_wake(fd);
+	}
+
+	if (out->queue.len > out->queue.size / 2)
+		return;
+
+	for (i = 0; i < out->waiters_count; ++i)
+		io_watch_wake(out->waiters[i]);
+	out->waiters_count = 0;
+}
+
+/*
+ * Queue output to caller's descriptors, so that a slow reader does not
+ * block other channels.  Caller's descriptors are made non-blocking
+ * only if the child does not use them.
+ */
+static void
+init_output(int nonblock)
+{
+	size_t  i;
+
+	for (i = 0; i < ARRAY_SIZE(io_out_list); ++i)
 	{
-		/* No child process and no descriptors to handle? */
-		if (max_fd <= 1)
-			return EXIT_FAILURE;
+		io_out_t out = &io_out_list[i];
+
+		ringbuf_init(&out->queue, relay_buffer_size);
+
+		if (nonblock)
+			out->saved_flags = fcntl(out->fd, F_GETFL);
 	}
 
-	rc = xselect(max_fd + 1, &read_fds, &write_fds, wlimit.time_idle);
-	if (!rc)
-		limit_exceeded("idle time limit (%lu seconds) exceeded",
-			       wlimit.time_idle);
-	else if (rc < 0)
-		return (errno == EINTR) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (atexit(restore_output))
+		error(EXIT_FAILURE, errno, "atexit");
 
-	if (fds_isset(&read_fds, io->slave_read_err_fd))
+	/* stdout and stderr may share the file description. */
+	for (i = 0; i < ARRAY_SIZE(io_out_list); ++i)
 	{
-		/* handle child stderr */
-		n = read_retry(io->slave_read_err_fd,
-			       io->slave_buf, sizeof io->slave_buf);
-		if (n <= 0)
-		{
-			io->slave_read_err_fd = -1;
-		} else
+		io_out_t out = &io_out_list[i];
+
+		if (out->saved_flags >= 0 && !(out->saved_flags & O_NONBLOCK))
+			unblock_fd(out->fd);
+
+		io_watch_add(out->fd, EPOLLOUT, handle_output, out);
+		out->armed = 1;
+	}
+}
+
+static int
+output_empty(void)
+{
+	size_t  i;
+
+	for (i = 0; i < ARRAY_SIZE(io_out_list); ++i)
+		if (io_out_list[i].queue.len)
+			return 0;
+	return 1;
+}
+
+/* Restore caller's descriptors and write out the queued data. */
+static void
+restore_output(void)
+{
+	size_t  i;
+
+	for (i = 0; i < ARRAY_SIZE(io_out_list); ++i)
+	{
+		io_out_t out = &io_out_list[i];
+
+		if (out->saved_flags >= 0)
 		{
-			xwrite_all(io->master_write_err_fd, io->slave_buf,
-				   (size_t) n);
+			(void) fcntl(out->fd, F_SETFL, out->saved_flags);
+			out->saved_flags = -1;
 		}
 	}
 
-	if (fds_isset(&read_fds, io->slave_read_out_fd))
+	for (i = 0; i < ARRAY_SIZE(io_out_list); ++i)
 	{
-		/* handle child stdout */
-		n = read_retry(io->slave_read_out_fd,
-			       io->slave_buf, sizeof io->slave_buf);
-		if (n <= 0)
+		io_out_t out = &io_out_list[i];
+
+		while (out->queue.len)
+			if (ringbuf_writev(&out->queue, out->fd) <= 0)
+				break;
+		ringbuf_free(&out->queue);
+	}
+}
+
+/* Chunks relayed from one descriptor before other channels get a turn. */
+#define IO_BUDGET 16
+
+/* Size of one splice() from the child output pipe. */
+#define IO_SPLICE_SIZE 65536
+
+/* Do not relay more than wlimit.bytes_written allows. */
+static size_t
+write_quota(size_t count)
+{
+	unsigned long left;
+
+	if (!wlimit.bytes_written)
+		return count;
+
+	if (total_bytes_written >= wlimit.bytes_written)
+		return 0;
+
+	left = wlimit.bytes_written - total_bytes_written;
+	return (left < count) ? (size_t) left : count;
+}
+
+/*
+ * Move data from the child output pipe to the caller's descriptor
+ * without copying it through user space.
+ */
+static ssize_t
+splice_output(int fd, int out_fd, size_t count)
+{
+	ssize_t n;
+
+	do
+	{
+		n = splice(fd, NULL, out_fd, NULL, count, SPLICE_F_MOVE);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0 && errno != EAGAIN && errno != EINVAL && errno != ENOSYS)
+		error(EXIT_FAILURE, errno, "splice");
+
+	return n;
+}
+
+/*
+ * splice() fails with EAGAIN both when the child pipe is empty and when
+ * the caller's descriptor is full, even if the child pipe is at EOF.
+ * In the latter case, wait for the caller's descriptor to become
+ * writable.
+ */
+static int
+splice_blocked(int fd, int out_fd)
+{
+	int     avail = 0;
+
+	if (ioctl(fd, FIONREAD, &avail) < 0
+	    || (!avail && !(io_ready(fd) & EPOLLHUP)))
+		return 0;
+
+	io_out_t out = output_get(out_fd);
+
+	io_ready_clear(out_fd, EPOLLOUT);
+	output_arm(out, 1);
+	output_add_waiter(out, fd);
+
+	return 1;
+}
+
+/* Read child output into the output queue. */
+static ssize_t
+read_output(int fd, int out_fd, size_t count)
+{
+	io_out_t out = output_get(out_fd);
+	size_t  space;
+	char   *tail = ringbuf_tail(&out->queue, &space);
+	ssize_t n;
+
+	if (count > space)
+		count = space;
+
+	if ((n = read_retry(fd, tail, count)) > 0)
+	{
+		ringbuf_commit(&out->queue, (size_t) n);
+		total_bytes_written += (unsigned long) n;
+		io_watch_wake(out_fd);
+	}
+
+	return n;
+}
+
+/* Relay child output to the caller. */
+static void
+handle_child_output(int fd, void *data)
+{
+	io_std_t io = data;
+	ssize_t n;
+	int     i;
+	int     out_fd, *no_splice;
+
+	if (fd == io->slave_read_err_fd)
+	{
+		out_fd = io->master_write_err_fd;
+		no_splice = &io->no_splice_err;
+	} else
+	{
+		out_fd = io->master_write_out_fd;
+		no_splice = &io->no_splice_out;
+	}
+
+	if (!(io_ready(fd) & EPOLLIN))
+		return;
+
+	for (i = 0; i < IO_BUDGET; ++i)
+	{
+		size_t  count;
+
+		/* work_limits_ok() stops the relay. */
+		if (!(count = write_quota(IO_SPLICE_SIZE)))
+			return;
+
+		if (!*no_splice)
 		{
-			io->slave_read_out_fd = -1;
+			/* Queued data goes first. */
+			if (!output_wait(out_fd, relay_buffer_size, fd))
+				return;
+
+			n = splice_output(fd, out_fd, count);
+			if (n < 0 && errno != EAGAIN)
+			{
+				/* The caller's descriptor does not support splice. */
+				*no_splice = 1;
+				continue;
+			}
+
+			if (n < 0 && splice_blocked(fd, out_fd))
+				return;
+
+			if (n > 0)
+				total_bytes_written += (unsigned long) n;
 		} else
 		{
-			xwrite_all(io->master_write_out_fd, io->slave_buf,
-				   (size_t) n);
+			/* Stop reading until there is room in the queue. */
+			if (!output_wait(out_fd, 1, fd))
+				return;
+
+			n = read_output(fd, out_fd, count);
 		}
-	}
 
-	if (io->master_avail && fds_isset(&write_fds, io->slave_write_fd))
-	{
-		/* handle child input */
-		n = write_loop(io->slave_write_fd,
-			       io->master_buf, io->master_avail);
-		if (n <= 0)
-			return EXIT_FAILURE;
+		if (n < 0 && errno == EAGAIN)
+		{
+			io_ready_clear(fd, EPOLLIN);
+			return;
+		}
 
-		if ((size_t) n < io->master_avail)
+		if (n <= 0)
 		{
-			memmove(io->master_buf,
-				io->master_buf + (size_t) n,
-				io->master_avail - (size_t) n);
+			if (fd == io->slave_read_err_fd)
+				io->slave_read_err_fd = -1;
+			else
+				io->slave_read_out_fd = -1;
+
+			/* The pty is also used for child input. */
+			if (fd != io->slave_write_fd)
+				io_watch_del(fd);
+			return;
 		}
+	}
 
-		total_bytes_read += io->master_avail;
-		io->master_avail -= (size_t) n;
+	/* Let other channels run before reading more. */
+	io_watch_wake(fd);
+}
+
+/* Relay tty input to the child. */
+static void
+handle_child_input(io_std_t io)
+{
+	ssize_t n;
+
+	if (!io->input.len || !(io_ready(io->slave_write_fd) & EPOLLOUT))
+		return;
+
+	n = ringbuf_writev(&io->input, io->slave_write_fd);
+	if (n < 0 && errno == EAGAIN)
+	{
+		io_ready_clear(io->slave_write_fd, EPOLLOUT);
+		return;
 	}
 
-	if (!io->master_avail && fds_isset(&read_fds, io->master_read_fd))
+	if (n <= 0)
 	{
-		/* handle tty input */
-		n = read_retry(io->master_read_fd,
-			       io->master_buf, sizeof io->master_buf);
-		if (n > 0)
-			io->master_avail = (size_t) n;
-		else if (n == 0)
-		{
-			io->master_buf[0] = 4;
-			io->master_avail = 1;
-		} else
-			io->master_read_fd = -1;
+		io_failed = 1;
+		return;
 	}
 
-	x11_handle_select(&read_fds, &write_fds, x11_saved_data,
-			  x11_fake_data);
-	x11_handle_new(x11_fd, &read_fds);
+	total_bytes_read += (unsigned long) n;
+
+	/* Retry until EAGAIN. */
+	if (io->input.len)
+		io_watch_wake(io->slave_write_fd);
 
-	log_handle_select(&read_fds);
-	log_handle_new(log_fd, &read_fds);
+	io_watch_wake(io->master_read_fd);
+}
+
+static void
+handle_pty(int fd, void *data)
+{
+	io_std_t io = data;
+
+	if (io->slave_write_fd >= 0)
+		handle_child_input(io);
+
+	if (io->slave_read_out_fd >= 0)
+		handle_child_output(fd, io);
 
-	if (fds_isset(&read_fds, ctl_fd))
+	if (io->slave_read_out_fd < 0 && io->slave_write_fd < 0)
+		io_watch_del(fd);
+}
+
+static void
+handle_tty_input(int fd, void *data)
+{
+	io_std_t io = data;
+	ssize_t n;
+	size_t  space;
+	char   *tail = ringbuf_tail(&io->input, &space);
+
+	if (!space || !(io_ready(fd) & EPOLLIN))
+		return;
+
+	n = read_retry(fd, tail, space);
+	if (n > 0)
+		ringbuf_commit(&io->input, (size_t) n);
+	else if (n == 0)
 	{
-		if ((x11_fd = handle_x11_ctl()) < 0)
-		{
-			x11_closedir();
-			error(EXIT_SUCCESS, 0, "X11 forwarding disabled\r");
-		}
-		(void) close(ctl_fd);
-		ctl_fd = -1;
+		/* Send EOF once the child has read everything before it. */
+		if (io->input.len)
+			return;
+		ringbuf_put(&io->input, "\4", 1UL);
+	} else if (errno == EAGAIN)
+	{
+		io_ready_clear(fd, EPOLLIN);
+		return;
+	} else
+	{
+		io_watch_del(fd);
+		io->master_read_fd = -1;
+		return;
 	}
 
-	return EXIT_SUCCESS;
+	io_watch_wake(io->slave_write_fd);
 }
 
-void
-xwrite_all(int fd, const char *buffer, size_t count)
+static void
+handle_ctl(int fd, void __attribute__ ((unused)) *data)
 {
-	if (write_loop(fd, buffer, count) != (ssize_t) count)
-		error(EXIT_FAILURE, errno, "write");
+	if (!(io_ready(fd) & EPOLLIN))
+		return;
 
-	total_bytes_written += count;
+	io_watch_del(fd);
+
+	if ((x11_fd = handle_x11_ctl()) < 0)
+	{
+		x11_closedir();
+		error(EXIT_SUCCESS, 0, "X11 forwarding disabled\r");
+	} else
+		x11_watch_listen(x11_fd, x11_saved_data, x11_fake_data);
+
+	(void) close(ctl_fd);
+	ctl_fd = -1;
+}
+
+/* Stop handling child input, tty input and listeners. */
+static void
+detach_child(io_std_t io)
+{
+	child_detached = 1;
+
+	io_watch_del(io->master_read_fd);
+	io_watch_del(log_fd);
+	io_watch_del(ctl_fd);
+	io_watch_del(x11_fd);
+
+	if (io->slave_write_fd >= 0)
+	{
+		if (io->slave_read_out_fd < 0)
+			io_watch_del(io->slave_write_fd);
+		io->slave_write_fd = -1;
+	}
+}
+
+static int
+handle_io(io_std_t io)
+{
+	int     rc;
+	const sigset_t sigmask = {};
+
+	if (sigwinch_arrived)
+	{
+		sigwinch_arrived = 0;
+		(void) tty_copy_winsize(STDIN_FILENO, pty_fd);
+	}
+
+	/* Child output, error, log and x11 descriptors are handled
+	   even after child process completion. */
+	if (!child_pid && !child_detached)
+		detach_child(io);
+
+	/* No child process and nothing but timers and empty output queues? */
+	if (!child_pid
+	    && io_watch_count() <= ARRAY_SIZE(io_out_list) + timer_count
+	    && output_empty())
+		return EXIT_FAILURE;
+
+	rc = io_loop_wait(-1, &sigmask);
+	if (rc < 0)
+		return (errno == EINTR) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+	return io_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int
@@ -372,11 +910,18 @@ handle_parent(pid_t a_child_pid, int a_pty_fd, int pipe_out, int pipe_err,
 
 	child_pid = a_child_pid;
 
-	act.sa_handler = sigchld_handler;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = (int) (SA_NOCLDSTOP | SA_RESETHAND);
-	if (sigaction(SIGCHLD, &act, 0))
-		error(EXIT_FAILURE, errno, "sigaction");
+	/* Track the child by pidfd if possible, otherwise rely on SIGCHLD. */
+	if ((child_pidfd = sys_pidfd_open(child_pid, 0)) < 0)
+	{
+		if (errno != ENOSYS)
+			error(EXIT_FAILURE, errno, "pidfd_open");
+
+		act.sa_handler = sigchld_handler;
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = (int) (SA_NOCLDSTOP | SA_RESETHAND);
+		if (sigaction(SIGCHLD, &act, 0))
+			error(EXIT_FAILURE, errno, "sigaction");
+	}
 
 	signal(SIGPIPE, SIG_IGN);
 
@@ -388,6 +933,11 @@ handle_parent(pid_t a_child_pid, int a_pty_fd, int pipe_out, int pipe_err,
 	io->slave_read_err_fd = use_pty ? -1 : pipe_err;
 	io->slave_write_fd = use_pty ? pty_fd : -1;
 
+	/* The pty is not a pipe. */
+	io->no_splice_out = io->no_splice_err = use_pty;
+
+	ringbuf_init(&io->input, relay_buffer_size);
+
 	if (pty_fd >= 0)
 		unblock_fd(pty_fd);
 	if (pipe_out >= 0)
@@ -406,12 +956,40 @@ handle_parent(pid_t a_child_pid, int a_pty_fd, int pipe_out, int pipe_err,
 			error(EXIT_FAILURE, errno, "sigaction");
 	}
 
-	log_fd = log_listen();
+	io_loop_init();
+
+	if (child_pidfd >= 0)
+		io_watch_add(child_pidfd, EPOLLIN, handle_child_exit, NULL);
+
+	init_timers();
+
+	/* Child's stdout and stderr are caller's ones if there are no pipes. */
+	init_output(use_pty || pipe_out >= 0);
+
+	if (use_pty)
+	{
+		io_watch_add(pty_fd, EPOLLIN | EPOLLOUT, handle_pty, io);
+		io_watch_add(io->master_read_fd, EPOLLIN, handle_tty_input, io);
+	} else
+	{
+		if (pipe_out >= 0)
+			io_watch_add(pipe_out, EPOLLIN, handle_child_output, io);
+		if (pipe_err >= 0)
+			io_watch_add(pipe_err, EPOLLIN, handle_child_output, io);
+	}
+
+	if (ctl_fd >= 0)
+		io_watch_add(ctl_fd, EPOLLIN, handle_ctl, NULL);
+
+	if ((log_fd = log_listen()) >= 0)
+		log_watch_listen(log_fd);
 
 	while (work_limits_ok(total_bytes_read, total_bytes_written))
 		if (handle_io(io) != EXIT_SUCCESS)
 			break;
 
+	restore_output();
+
 	/* Close master pty descriptor, thus sending HUP to child session. */
 	(void) close(pty_fd);
 
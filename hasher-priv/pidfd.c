@@ -0,0 +1,40 @@
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "pidfd.h"
+
+/* idtype_t value of P_PIDFD, not exported as a macro by libc. */
+#define IDTYPE_PIDFD 3
+
+int
+sys_pidfd_open(pid_t pid, unsigned int flags)
+{
+#ifdef __NR_pidfd_open
+	return (int) syscall(__NR_pidfd_open, pid, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int
+sys_pidfd_send_signal(int pidfd, int sig)
+{
+#ifdef __NR_pidfd_send_signal
+	return (int) syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int
+pidfd_waitid(int pidfd, siginfo_t *info, int options)
+{
+	return (int) TEMP_FAILURE_RETRY(waitid((idtype_t) IDTYPE_PIDFD, (id_t) pidfd, info, options));
+}
@@ -0,0 +1,16 @@
+#ifndef _PIDFD_H_
+#define _PIDFD_H_
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+/*
+ * Thin wrappers around process file descriptor syscalls.
+ * All of them fail with ENOSYS if the kernel or headers lack support,
+ * so callers are expected to fall back to pid-based interfaces.
+ */
+int sys_pidfd_open(pid_t pid, unsigned int flags);
+int sys_pidfd_send_signal(int pidfd, int sig);
+int pidfd_waitid(int pidfd, siginfo_t *info, int options);
+
+#endif /* _PIDFD_H_ */
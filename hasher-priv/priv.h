@@ -42,22 +42,38 @@ typedef struct
 {
 	unsigned long time_elapsed;
 	unsigned long time_idle;
+	unsigned long time_cpu;
 	unsigned long bytes_read;
 	unsigned long bytes_written;
+	unsigned long bytes_rss;
 } work_limit_t;
 
+typedef struct
+{
+	const char *name;
+	const char *file;
+	const char *value;
+	int     fd;
+} cgroup_limit_t;
+
+typedef struct
+{
+	const char *user;
+	uid_t   uid;
+	unsigned count;
+} prefork_t;
+
 typedef void (*VALIDATE_FPTR)(struct stat *, const char *);
 
 void    sanitize_fds(void);
 void    cloexec_fds(void);
 void    nullify_stdin(void);
 void    unblock_fd(int fd);
-void    fds_add_fd(fd_set *fds, int *max_fd, const int fd);
-int     fds_isset(fd_set *fds, const int fd);
 ssize_t read_retry(int fd, void *buf, size_t count);
 ssize_t write_retry(int fd, const void *buf, size_t count);
 ssize_t write_loop(int fd, const char *buffer, size_t count);
-void    xwrite_all(int fd, const char *buffer, size_t count);
+int     output_wait(int out_fd, size_t count, int fd);
+void    output_queue(int out_fd, const char *buffer, size_t count);
 int     init_tty(void);
 void    restore_tty(void);
 int     tty_copy_winsize(int master_fd, int slave_fd);
@@ -95,15 +111,9 @@ int     x11_listen(void);
 int     x11_connect(void);
 int     x11_check_listen(int fd);
 
-void    log_handle_new(const int log_fd, fd_set *read_fds);
-void    fds_add_log(fd_set *read_fds, int *max_fd);
-void    log_handle_select(fd_set *read_fds);
-
-void    x11_handle_new(const int x11_fd, fd_set *read_fds);
-void    fds_add_x11(fd_set *read_fds, fd_set *write_fds, int *max_fd);
-void    x11_handle_select(fd_set *read_fds, fd_set *write_fds,
-			  const char *x11_saved_data,
-			  const char *x11_fake_data);
+void    log_watch_listen(const int log_fd);
+void    x11_watch_listen(const int x11_fd, const char *x11_saved_data,
+			 const char *x11_fake_data);
 
 int	test_unshare_mount(void);
 void	setup_mountpoints(void);
@@ -113,6 +123,10 @@ void	unshare_mount(void);
 void	unshare_network(void);
 void	unshare_uts(void);
 
+char   *getconf_output(void);
+char   *getugid1_output(void);
+char   *getugid2_output(void);
+
 int     do_getconf(void);
 int     do_killuid(void);
 int     do_getugid1(void);
@@ -126,12 +140,13 @@ int     do_mount(void);
 int     do_umount(void);
 
 int caller_task(int);
-pid_t fork_server(int, uid_t, gid_t, unsigned);
+pid_t fork_server(int, int *, uid_t, gid_t, unsigned, int *);
 
 extern const char *chroot_path;
 extern const char **chroot_argv;
 
 extern const char **task_args;
+extern const char *batch_file;
 
 extern const char *single_mountpoint;
 extern const char *allowed_mountpoints;
@@ -142,6 +157,7 @@ extern const char *x11_display, *x11_key;
 
 extern int allow_tty_devices, use_pty;
 extern size_t x11_data_len;
+extern size_t relay_buffer_size;
 extern int share_caller_network;
 extern int unshared_mount;
 extern int share_ipc;
@@ -163,9 +179,14 @@ extern mode_t change_umask;
 extern int change_nice;
 extern change_rlimit_t change_rlimit[];
 extern work_limit_t wlimit;
+extern cgroup_limit_t cgroup_limits[];
+extern int report_usage;
 
 extern int server_log_priority;
 extern unsigned long server_session_timeout;
+extern unsigned long server_listen_backlog;
+extern prefork_t *server_prefork;
+extern size_t server_prefork_size;
 extern const char *server_controlgroup;
 extern const char *server_pidfile;
 extern gid_t server_gid;
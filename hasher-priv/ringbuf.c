@@ -0,0 +1,113 @@
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+#include "xmalloc.h"
+
+/*
+ * Fixed-size byte queue. Queued data takes at most two segments, so
+ * it is written out with a single writev() and never moved.
+ */
+
+void
+ringbuf_init(struct ringbuf *rb, size_t size)
+{
+	rb->data = xmalloc(size);
+	rb->size = size;
+	rb->head = rb->len = 0;
+}
+
+void
+ringbuf_free(struct ringbuf *rb)
+{
+	free(rb->data);
+	rb->data = NULL;
+	rb->size = rb->head = rb->len = 0;
+}
+
+size_t
+ringbuf_space(const struct ringbuf *rb)
+{
+	return rb->size - rb->len;
+}
+
+/* Return the contiguous free area after the queued data. */
+char *
+ringbuf_tail(struct ringbuf *rb, size_t *count)
+{
+	size_t tail = rb->head + rb->len;
+
+	if (tail < rb->size) {
+		*count = rb->size - tail;
+		return rb->data + tail;
+	}
+
+	tail -= rb->size;
+	*count = rb->head - tail;
+
+	return rb->data + tail;
+}
+
+/* Queue COUNT bytes stored at ringbuf_tail(). */
+void
+ringbuf_commit(struct ringbuf *rb, size_t count)
+{
+	rb->len += count;
+}
+
+/* The caller makes sure there is enough space. */
+void
+ringbuf_put(struct ringbuf *rb, const char *buf, size_t count)
+{
+	while (count > 0) {
+		size_t n;
+		char *p = ringbuf_tail(rb, &n);
+
+		if (!n)
+			break;
+		if (n > count)
+			n = count;
+
+		memcpy(p, buf, n);
+		ringbuf_commit(rb, n);
+
+		buf += n;
+		count -= n;
+	}
+}
+
+ssize_t
+ringbuf_writev(struct ringbuf *rb, int fd)
+{
+	struct iovec iov[2];
+	int iovcnt = 1;
+	ssize_t n;
+
+	iov[0].iov_base = rb->data + rb->head;
+	iov[0].iov_len = rb->size - rb->head;
+
+	if (iov[0].iov_len >= rb->len) {
+		iov[0].iov_len = rb->len;
+	} else {
+		iov[1].iov_base = rb->data;
+		iov[1].iov_len = rb->len - iov[0].iov_len;
+		iovcnt = 2;
+	}
+
+	do {
+		n = writev(fd, iov, iovcnt);
+	} while (n < 0 && errno == EINTR);
+
+	if (n > 0) {
+		rb->head = (rb->head + (size_t) n) % rb->size;
+		rb->len -= (size_t) n;
+
+		/* Keep the free area contiguous. */
+		if (!rb->len)
+			rb->head = 0;
+	}
+
+	return n;
+}
@@ -0,0 +1,22 @@
+#ifndef _RINGBUF_H_
+#define _RINGBUF_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+
+struct ringbuf {
+	char *data;
+	size_t size;
+	size_t head;	/* offset of the first queued byte */
+	size_t len;	/* number of queued bytes */
+};
+
+void ringbuf_init(struct ringbuf *rb, size_t size);
+void ringbuf_free(struct ringbuf *rb);
+size_t ringbuf_space(const struct ringbuf *rb);
+char *ringbuf_tail(struct ringbuf *rb, size_t *count);
+void ringbuf_commit(struct ringbuf *rb, size_t count);
+void ringbuf_put(struct ringbuf *rb, const char *buf, size_t count);
+ssize_t ringbuf_writev(struct ringbuf *rb, int fd);
+
+#endif /* _RINGBUF_H_ */
@@ -0,0 +1,226 @@
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "xmalloc.h"
+#include "session.h"
+
+/*
+ * The session table is a pair of chained hash tables sharing the same
+ * entries: the primary one is keyed by (caller_uid, caller_num), the
+ * secondary one by the pid of the session server. Both grow together
+ * to keep the load factor below one, so lookup, insert and removal
+ * cost O(1) regardless of the number of live sessions.
+ *
+ * Sessions tracked by a process file descriptor are also indexed
+ * directly by that descriptor.
+ */
+
+#define SESSION_MIN_BUCKETS 64
+
+static struct session **by_key;
+static struct session **by_pid;
+static size_t nbuckets;
+static size_t nsessions;
+
+static struct session **by_pidfd;
+static size_t by_pidfd_size;
+
+static size_t
+hash_key(uid_t uid, unsigned num)
+{
+	uint64_t h = ((uint64_t) uid << 32) | num;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return (size_t) h & (nbuckets - 1);
+}
+
+static size_t
+hash_pid(pid_t pid)
+{
+	uint32_t h = (uint32_t) pid * 2654435761U;
+
+	return (size_t) (h ^ (h >> 16)) & (nbuckets - 1);
+}
+
+static void
+link_session(struct session *s)
+{
+	size_t i;
+
+	i = hash_key(s->caller_uid, s->caller_num);
+	s->next_by_key = by_key[i];
+	by_key[i] = s;
+
+	i = hash_pid(s->server_pid);
+	s->next_by_pid = by_pid[i];
+	by_pid[i] = s;
+}
+
+static void
+resize_table(size_t size)
+{
+	size_t i, old_nbuckets = nbuckets;
+	struct session **old_by_key = by_key;
+
+	by_key = xcalloc(size, sizeof(*by_key));
+	free(by_pid);
+	by_pid = xcalloc(size, sizeof(*by_pid));
+	nbuckets = size;
+
+	for (i = 0; i < old_nbuckets; i++) {
+		struct session *s, *next;
+
+		for (s = old_by_key[i]; s; s = next) {
+			next = s->next_by_key;
+			link_session(s);
+		}
+	}
+
+	free(old_by_key);
+}
+
+struct session *
+session_lookup(uid_t uid, unsigned num)
+{
+	struct session *s;
+
+	if (!nsessions)
+		return NULL;
+
+	for (s = by_key[hash_key(uid, num)]; s; s = s->next_by_key) {
+		if (s->caller_uid == uid && s->caller_num == num)
+			return s;
+	}
+
+	return NULL;
+}
+
+struct session *
+session_lookup_pid(pid_t pid)
+{
+	struct session *s;
+
+	if (!nsessions)
+		return NULL;
+
+	for (s = by_pid[hash_pid(pid)]; s; s = s->next_by_pid) {
+		if (s->server_pid == pid)
+			return s;
+	}
+
+	return NULL;
+}
+
+struct session *
+session_lookup_pidfd(int pidfd)
+{
+	if (pidfd < 0 || (size_t) pidfd >= by_pidfd_size)
+		return NULL;
+	return by_pidfd[pidfd];
+}
+
+struct session *
+session_insert(uid_t uid, gid_t gid, unsigned num, pid_t pid)
+{
+	struct session *s;
+
+	if (!nbuckets)
+		resize_table(SESSION_MIN_BUCKETS);
+	else if (nsessions >= nbuckets)
+		resize_table(nbuckets * 2);
+
+	s = xcalloc(1UL, sizeof(*s));
+
+	s->caller_uid = uid;
+	s->caller_gid = gid;
+	s->caller_num = num;
+	s->server_pid = pid;
+	s->server_pidfd = -1;
+	s->server_ctl = -1;
+
+	link_session(s);
+	nsessions++;
+
+	return s;
+}
+
+void
+session_set_pidfd(struct session *s, int pidfd)
+{
+	if ((size_t) pidfd >= by_pidfd_size) {
+		size_t i, size = (size_t) pidfd + 1;
+
+		if (size < by_pidfd_size * 2)
+			size = by_pidfd_size * 2;
+
+		by_pidfd = xrealloc(by_pidfd, size, sizeof(*by_pidfd));
+
+		for (i = by_pidfd_size; i < size; i++)
+			by_pidfd[i] = NULL;
+
+		by_pidfd_size = size;
+	}
+
+	by_pidfd[pidfd] = s;
+	s->server_pidfd = pidfd;
+}
+
+/*
+ * Unlink the session from all indexes and free it.
+ * The process file descriptor is not closed here.
+ */
+void
+session_remove(struct session *s)
+{
+	struct session **a;
+
+	for (a = &by_key[hash_key(s->caller_uid, s->caller_num)]; *a; a = &(*a)->next_by_key) {
+		if (*a == s) {
+			*a = s->next_by_key;
+			break;
+		}
+	}
+
+	for (a = &by_pid[hash_pid(s->server_pid)]; *a; a = &(*a)->next_by_pid) {
+		if (*a == s) {
+			*a = s->next_by_pid;
+			break;
+		}
+	}
+
+	if (s->server_pidfd >= 0)
+		by_pidfd[s->server_pidfd] = NULL;
+
+	nsessions--;
+	free(s);
+}
+
+/*
+ * Call FN for every session. FN is allowed to remove the session
+ * it was called for.
+ */
+void
+session_foreach(session_fn_t fn, void *data)
+{
+	size_t i;
+
+	for (i = 0; nsessions && i < nbuckets; i++) {
+		struct session *s, *next;
+
+		for (s = by_key[i]; s; s = next) {
+			next = s->next_by_key;
+			fn(s, data);
+		}
+	}
+}
+
+size_t
+session_count(void)
+{
+	return nsessions;
+}
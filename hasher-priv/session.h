@@ -0,0 +1,43 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <time.h>
+
+struct session {
+	/* hash chain by (caller_uid, caller_num) */
+	struct session *next_by_key;
+
+	/* hash chain by server_pid */
+	struct session *next_by_pid;
+
+	uid_t caller_uid;
+	gid_t caller_gid;
+
+	unsigned caller_num;
+
+	pid_t server_pid;
+
+	/* process file descriptor of the session server or -1 */
+	int server_pidfd;
+
+	/* control socket used to hand connections to the session server */
+	int server_ctl;
+
+	/* monotonic time when the session server was started */
+	time_t start_time;
+};
+
+typedef void (*session_fn_t)(struct session *, void *);
+
+struct session *session_lookup(uid_t uid, unsigned num);
+struct session *session_lookup_pid(pid_t pid);
+struct session *session_lookup_pidfd(int pidfd);
+struct session *session_insert(uid_t uid, gid_t gid, unsigned num, pid_t pid);
+void session_set_pidfd(struct session *s, int pidfd);
+void session_remove(struct session *s);
+void session_foreach(session_fn_t fn, void *data);
+size_t session_count(void);
+
+#endif /* _SESSION_H_ */
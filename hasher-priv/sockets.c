@@ -14,7 +14,7 @@
 
 /* This function may be executed with caller or child privileges. */
 
-int unix_listen(const char *dir_name, const char *file_name)
+int unix_listen_backlog(const char *dir_name, const char *file_name, int backlog)
 {
 	struct sockaddr_un sun;
 
@@ -45,7 +45,7 @@ int unix_listen(const char *dir_name, const char *file_name)
 		return -1;
 	}
 
-	if (listen(fd, 16) < 0) {
+	if (listen(fd, backlog) < 0) {
 		err("listen: %s: %m", sun.sun_path);
 		(void)close(fd);
 		return -1;
@@ -54,6 +54,11 @@ int unix_listen(const char *dir_name, const char *file_name)
 	return fd;
 }
 
+int unix_listen(const char *dir_name, const char *file_name)
+{
+	return unix_listen_backlog(dir_name, file_name, 16);
+}
+
 int unix_connect(const char *dir_name, const char *file_name)
 {
 	struct sockaddr_un sun;
@@ -2,6 +2,7 @@
 #define _SOCKETS_H_
 
 int unix_listen(const char *, const char *);
+int unix_listen_backlog(const char *, const char *, int);
 int unix_connect(const char *, const char *);
 
 int get_peercred(int, pid_t *, uid_t *, gid_t *);
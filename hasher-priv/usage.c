@@ -0,0 +1,130 @@
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "usage.h"
+
+/*
+ * Resource usage of a process tree, summed over all processes of its
+ * session. Time of reaped processes is included through cutime and
+ * cstime of their ancestors.
+ *
+ * /proc is opened before chroot, the relay cannot reach it afterwards.
+ *
+ * When the child runs in its own cgroup, its counters are used instead:
+ * they also cover processes which left the session, and reading them
+ * does not depend on the number of processes.
+ */
+
+static DIR *proc_dir;
+
+int
+usage_init(void)
+{
+	int fd;
+
+	if ((fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if (!(proc_dir = fdopendir(fd))) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+read_stat(int dir_fd, const char *name, char *buf, size_t size)
+{
+	char path[64];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/stat", name);
+
+	if ((fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	n = read(fd, buf, size - 1);
+	close(fd);
+
+	if (n <= 0)
+		return -1;
+
+	buf[n] = '\0';
+	return 0;
+}
+
+int
+usage_get(pid_t sid, struct usage *u)
+{
+	unsigned long long ticks = 0, pages = 0;
+	long tck = sysconf(_SC_CLK_TCK);
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct cgroup_stat st;
+	struct dirent *de;
+	int have_cpu = 0;
+
+	if (!cgroup_task_stat(&st)) {
+		u->cpu_msec = st.usage_usec / 1000;
+		if (st.has_memory) {
+			u->rss = st.memory_rss;
+			return 0;
+		}
+		have_cpu = 1;
+	}
+
+	if (!proc_dir) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	rewinddir(proc_dir);
+
+	while ((de = readdir(proc_dir))) {
+		unsigned long long utime, stime;
+		long long cutime, cstime;
+		long rss;
+		int session;
+		char buf[1024], *p;
+
+		if (de->d_name[0] < '1' || de->d_name[0] > '9')
+			continue;
+
+		/* The process may be gone already. */
+		if (read_stat(dirfd(proc_dir), de->d_name, buf, sizeof(buf)) < 0)
+			continue;
+
+		/* Command name may contain anything, skip it. */
+		if (!(p = strrchr(buf, ')')))
+			continue;
+
+		if (sscanf(p + 2, "%*c %*d %*d %d %*d %*d %*u %*u %*u %*u %*u "
+			   "%llu %llu %lld %lld %*d %*d %*d %*d %*u %*u %ld",
+			   &session, &utime, &stime, &cutime, &cstime, &rss) != 6)
+			continue;
+
+		if (session != sid)
+			continue;
+
+		ticks += utime + stime;
+		if (cutime > 0)
+			ticks += (unsigned long long) cutime;
+		if (cstime > 0)
+			ticks += (unsigned long long) cstime;
+		if (rss > 0)
+			pages += (unsigned long long) rss;
+	}
+
+	if (!have_cpu)
+		u->cpu_msec = tck > 0 ? ticks * 1000 / (unsigned long long) tck : 0;
+	u->rss = pages * (unsigned long long) page_size;
+
+	return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef _USAGE_H_
+#define _USAGE_H_
+
+#include <sys/types.h>
+
+struct usage {
+	unsigned long long cpu_msec;	/* user and system time */
+	unsigned long long rss;		/* resident set size, in bytes */
+};
+
+int usage_init(void);
+int usage_get(pid_t sid, struct usage *u);
+
+#endif /* _USAGE_H_ */
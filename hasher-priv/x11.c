@@ -201,7 +201,7 @@ unix_accept(int fd)
 
 	int     rc = accept(fd, (struct sockaddr *) &sun, &len);
 
-	if (rc < 0)
+	if (rc < 0 && errno != EAGAIN)
 	{
 		error(EXIT_SUCCESS, errno, "accept");
 		fputc('\r', stderr);